@@ -11,49 +11,250 @@
 #define HTML_H
 
 #include <stdio.h>
+#include <cctype>
 #include <iostream>
 #include <cstring>
 #include <vector>
 #include <map>
 #include <set>
+#include <algorithm>
+#include <functional>
 
 #if __cplusplus <= 199711L
     #if linux
         #include <tr1/memory>
+        #include <tr1/unordered_map>
     #else
         #include <memory>
+        #include <unordered_map>
     #endif
     using std::tr1::enable_shared_from_this;
     using std::tr1::shared_ptr;
     using std::tr1::weak_ptr;
+    using std::tr1::unordered_map;
 #else
     #include <memory>
+    #include <unordered_map>
     using std::enable_shared_from_this;
     using std::shared_ptr;
     using std::weak_ptr;
+    using std::unordered_map;
 #endif
 // Begin selector query
-typedef struct selector_t {
-    std::string tag;
+/**
+ * one attribute condition, [key], [key=val], [key~=val] ...
+ * exp is empty for a presence test, otherwise one of
+ * = ~= |= ^= $= *= !=
+ */
+typedef struct selector_attr_t {
     std::string key;
     std::string val;
-    std::string exp = "=";
-    bool all = false;
+    std::string exp;
+} selector_attr_t;
+
+/**
+ * one compound selector, e.g. div#main.item[href].
+ * combinator joins it to the compound on its left:
+ * ' ' for descendant, '>' for child, 0 for the first compound.
+ */
+typedef struct selector_t {
+    std::string tag;
+    std::string id;
+    std::set<std::string> classes;
+    std::vector<selector_attr_t> attrs;
+    char combinator = 0;
 } selector_t;
 typedef std::vector<selector_t> query_t;
 typedef std::vector<query_t> simple_selector;
 
-simple_selector parse_selector(const std::string selector) {
+inline bool is_selector_ident(char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || static_cast<unsigned char>(c) >= 0x80;
+}
+
+inline bool is_selector_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * compile a selector group ("a, b") of compound selectors joined by
+ * descendant or child combinators.
+ * @return the compiled group, empty if the selector is malformed
+ */
+inline simple_selector parse_selector(const std::string &selector) {
     simple_selector selectors;
-    if (selector.length() == 0) {
-        return selectors;
+    query_t query;
+    selector_t compound;
+    bool has_compound = false;
+    char combinator = 0;
+    size_t index = 0;
+    size_t length = selector.length();
+
+    while (length > index) {
+        char input = selector[index];
+        if (is_selector_blank(input)) {
+            if (has_compound) {
+                compound.combinator = combinator;
+                query.push_back(compound);
+                compound = selector_t();
+                has_compound = false;
+                combinator = ' ';
+            }
+            index++;
+        } else if (input == '>' || input == ',') {
+            if (has_compound) {
+                compound.combinator = combinator;
+                query.push_back(compound);
+                compound = selector_t();
+                has_compound = false;
+            }
+            if (query.empty()) {
+                return simple_selector();
+            }
+            if (input == ',') {
+                selectors.push_back(query);
+                query.clear();
+                combinator = 0;
+            } else {
+                combinator = '>';
+            }
+            index++;
+        } else if (input == '*') {
+            if (has_compound) {
+                return simple_selector();
+            }
+            has_compound = true;
+            index++;
+        } else if (input == '#' || input == '.') {
+            size_t begin = ++index;
+            while (length > index && is_selector_ident(selector[index])) {
+                index++;
+            }
+            if (index == begin) {
+                return simple_selector();
+            }
+            if (input == '#') {
+                compound.id = selector.substr(begin, index - begin);
+            } else {
+                compound.classes.insert(selector.substr(begin, index - begin));
+            }
+            has_compound = true;
+        } else if (input == '[') {
+            selector_attr_t attr;
+            size_t end = selector.find(']', index);
+            if (end == std::string::npos) {
+                return simple_selector();
+            }
+            size_t begin = ++index;
+            while (end > index && is_selector_blank(selector[index])) {
+                begin = ++index;
+            }
+            while (end > index && is_selector_ident(selector[index])) {
+                index++;
+            }
+            attr.key = selector.substr(begin, index - begin);
+            while (end > index && is_selector_blank(selector[index])) {
+                index++;
+            }
+            begin = index;
+            while (end > index && selector[index] && strchr("~|^$*!=", selector[index])) {
+                index++;
+            }
+            attr.exp = selector.substr(begin, index - begin);
+            while (end > index && is_selector_blank(selector[index])) {
+                index++;
+            }
+            if (end > index && (selector[index] == '"' || selector[index] == '\'')) {
+                size_t quote = selector.find(selector[index], index + 1);
+                if (quote == std::string::npos) {
+                    return simple_selector();
+                }
+                end = selector.find(']', quote);
+                if (end == std::string::npos) {
+                    return simple_selector();
+                }
+                attr.val = selector.substr(index + 1, quote - index - 1);
+                index = quote + 1;
+            } else {
+                begin = index;
+                while (end > index && !is_selector_blank(selector[index])) {
+                    index++;
+                }
+                attr.val = selector.substr(begin, index - begin);
+            }
+            while (end > index && is_selector_blank(selector[index])) {
+                index++;
+            }
+            static const char *ops[] = { "", "=", "~=", "|=", "^=", "$=", "*=", "!=" };
+            bool known = false;
+            for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+                known = known || attr.exp == ops[i];
+            }
+            if (attr.key.empty() || index != end || !known || (attr.exp.empty() && !attr.val.empty())) {
+                return simple_selector();
+            }
+            compound.attrs.push_back(attr);
+            has_compound = true;
+            index = end + 1;
+        } else if (is_selector_ident(input)) {
+            if (has_compound) {
+                return simple_selector();
+            }
+            size_t begin = index;
+            while (length > index && is_selector_ident(selector[index])) {
+                index++;
+            }
+            compound.tag = selector.substr(begin, index - begin);
+            has_compound = true;
+        } else {
+            return simple_selector();
+        }
     }
-    if (selector[0] == '*') {
-        
+
+    if (has_compound) {
+        compound.combinator = combinator;
+        query.push_back(compound);
+    } else if (combinator == '>' || (query.empty() && !selectors.empty())) {
+        return simple_selector();
+    }
+    if (!query.empty()) {
+        selectors.push_back(query);
     }
     return selectors;
 }
 
+/**
+ * parse diagnostics, reported instead of being printed
+ */
+enum HtmlDiagnosticCode {
+    HTML_ATTRIBUTE_UNEXPECTED_QUOTE,  // quote inside an attribute name
+    HTML_ELEMENT_NOT_CLOSED,          // element implicitly closed by an ancestor's close tag
+    HTML_UNEXPECTED_CLOSE_TAG         // close tag matching no open element, ignored
+};
+
+typedef struct HtmlDiagnostic {
+    HtmlDiagnosticCode code;
+    size_t offset;      // byte offset in the parsed input
+    std::string name;   // element or close tag name, the quote character for attributes
+} HtmlDiagnostic;
+
+/**
+ * heap bytes held by a document, estimated per category.
+ * allocator bookkeeping is not included.
+ */
+typedef struct HtmlMemoryUsage {
+    size_t nodes;       // elements and their shared_ptr control blocks
+    size_t strings;     // element names and text values
+    size_t attributes;  // attribute maps, class name sets and untokenized attribute bytes
+    size_t children;    // child vectors
+    size_t indexes;     // id / class / tag lookup indexes, empty until the first GetElementBy* call
+
+    size_t Total() const {
+        return nodes + strings + attributes + children + indexes;
+    }
+} HtmlMemoryUsage;
+
+class HtmlSelector;
+
 /**
  * class HtmlElement
  * HTML Element struct
@@ -62,17 +263,24 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
     public:
         friend class HtmlParser;
         friend class HtmlDocument;
+        friend class HtmlSelector;
         /**
          * for children traversals.
          */
         typedef std::vector<shared_ptr<HtmlElement> >::const_iterator ChildIterator;
 
         const shared_ptr<HtmlElement> first_child() {
-            return *children.begin();
+            if (children.empty()) {
+                return shared_ptr<HtmlElement>();
+            }
+            return children.front();
         }
 
         const shared_ptr<HtmlElement> last_child() {
-            return *children.end();
+            if (children.empty()) {
+                return shared_ptr<HtmlElement>();
+            }
+            return children.back();
         }
 
         /**
@@ -81,18 +289,43 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
         typedef std::map<std::string, std::string>::const_iterator AttributeIterator;
 
         const AttributeIterator AttributeBegin() {
+            ParseAttribute();
             return attribute.begin();
         }
 
         const AttributeIterator AttributeEnd() {
+            ParseAttribute();
             return attribute.end();
         }
 
-        HtmlElement() {}
+        HtmlElement() : parent(NULL), index(0) {}
 
-        HtmlElement(shared_ptr<HtmlElement> p) : parent(p) {}
+        HtmlElement(const shared_ptr<HtmlElement> &p) : parent(p.get()), index(0) {}
+
+        /**
+         * release descendants iteratively, a deep tree would otherwise
+         * overflow the stack through nested shared_ptr destructors.
+         * subtrees still referenced from elsewhere are left intact and
+         * become detached, their GetParent() returns null.
+         */
+        ~HtmlElement() {
+            std::vector<shared_ptr<HtmlElement> > pending;
+            pending.swap(children);
+            while (!pending.empty()) {
+                shared_ptr<HtmlElement> element;
+                element.swap(pending.back());
+                pending.pop_back();
+                if (element.use_count() == 1) {
+                    pending.insert(pending.end(), element->children.begin(), element->children.end());
+                    element->children.clear();
+                } else {
+                    element->parent = NULL;
+                }
+            }
+        }
 
         std::string GetAttribute(const std::string &k) {
+            ParseAttribute();
             if (attribute.find(k) != attribute.end()) {
                 return attribute[k];
             }
@@ -105,7 +338,7 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
 
         std::vector<shared_ptr<HtmlElement> > GetElementByClassName(const std::string &name) {
             std::vector<shared_ptr<HtmlElement> > result;
-            HtmlElement::GetElementByClassName(shared_from_this(), name, result);
+            HtmlElement::GetElementByClassName(shared_from_this(), SplitClassName(name), result);
             return result;
         }
 
@@ -116,7 +349,10 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
         }
 
         shared_ptr<HtmlElement> GetParent() {
-            return parent.lock();
+            if (!parent) {
+                return shared_ptr<HtmlElement>();
+            }
+            return parent->shared_from_this();
         }
 
         const std::string &GetValue() {
@@ -127,92 +363,107 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
             return name;
         }
 
-        shared_ptr<HtmlElement> child(size_t index) {
-            if (index < 0) {
-                index = children.size() + index;
+        /**
+         * child by position, negative positions count from the last child.
+         */
+        shared_ptr<HtmlElement> child(long pos) {
+            if (pos < 0) {
+                pos += static_cast<long>(children.size());
             }
-            if (index < 0 || index >= children.size()) {
+            if (pos < 0 || static_cast<size_t>(pos) >= children.size()) {
                 return shared_ptr<HtmlElement>();
             }
-            return children[index];
+            return children[pos];
         }
 
         shared_ptr<HtmlElement> next() {
-            shared_ptr<HtmlElement> p = GetParent();
-            if (p) {
-                size_t idx = 0;
-                size_t count = p->children.size();
-                while(idx < count && shared_from_this() != p->children[idx]) {
-                    ++idx;
-                }
-                if (++idx >= count) {
-                    return shared_ptr<HtmlElement>();
-                }
-                return p->children[idx];
+            if (parent && index + 1 < parent->children.size()) {
+                return parent->children[index + 1];
             }
             return shared_ptr<HtmlElement>();
         }
 
         shared_ptr<HtmlElement> prev() {
-            shared_ptr<HtmlElement> p = GetParent();
-            if (p) {
-                size_t idx = 0;
-                size_t count = p->children.size();
-                while(idx < count && shared_from_this() != p->children[idx]) {
-                    ++idx;
-                }
-                if(--idx < 0) {
-                    return shared_ptr<HtmlElement>();
-                }
-                return p->children[idx];
+            if (parent && index > 0) {
+                return parent->children[index - 1];
             }
             return shared_ptr<HtmlElement>();
         }
-        std::vector<shared_ptr<HtmlElement> > find(std::string selector) {
-            std::vector<shared_ptr<HtmlElement> > result;
+        /**
+         * descendants matching a CSS selector, in document order.
+         * ancestors above this element count for combinators.
+         */
+        std::vector<shared_ptr<HtmlElement> > find(const std::string &selector);
 
-            return result;
-        }
+        std::vector<shared_ptr<HtmlElement> > find(const HtmlSelector &selector);
     private:
-        static shared_ptr<HtmlElement> GetElementById(const shared_ptr<HtmlElement> &element, const std::string &id) {
-            for (HtmlElement::ChildIterator it = element->children.begin(); it != element->children.end(); ++it) {
-                if ((*it)->GetAttribute("id") == id)
-                    return *it;
+        /**
+         * preorder walk over descendants with an explicit stack:
+         * seed it with PushChildren(root), then call NextInPreorder until empty.
+         */
+        static void PushChildren(const HtmlElement &element, std::vector<HtmlElement *> &stack) {
+            for (std::vector<shared_ptr<HtmlElement> >::const_reverse_iterator it = element.children.rbegin(); it != element.children.rend(); ++it) {
+                stack.push_back(it->get());
+            }
+        }
 
-                shared_ptr<HtmlElement> r = GetElementById(*it, id);
-                if (r)
-                    return r;
+        static HtmlElement *NextInPreorder(std::vector<HtmlElement *> &stack) {
+            HtmlElement *element = stack.back();
+            stack.pop_back();
+            PushChildren(*element, stack);
+            return element;
+        }
+
+        static shared_ptr<HtmlElement> GetElementById(const shared_ptr<HtmlElement> &element, const std::string &id) {
+            std::vector<HtmlElement *> stack;
+            PushChildren(*element, stack);
+            while (!stack.empty()) {
+                HtmlElement *it = NextInPreorder(stack);
+                if (it->GetAttribute("id") == id)
+                    return it->shared_from_this();
             }
             return shared_ptr<HtmlElement>();
         }
 
-        static void GetElementByClassName(const shared_ptr<HtmlElement> &element, const std::string &name, std::vector<shared_ptr<HtmlElement> > &result) {
-            for (HtmlElement::ChildIterator it = element->children.begin(); it != element->children.end(); ++it) {
-                std::set<std::string> attr_class = SplitClassName((*it)->GetAttribute("class"));
-                std::set<std::string> class_name = SplitClassName(name);
-                std::set<std::string>::const_iterator iter = class_name.begin();
-                for(; iter != class_name.end(); ++iter){
-                    if(attr_class.find(*iter) == attr_class.end()){
-                        break;
-                    }
+        static void GetElementByClassName(const shared_ptr<HtmlElement> &element, const std::set<std::string> &class_name, std::vector<shared_ptr<HtmlElement> > &result) {
+            std::vector<HtmlElement *> stack;
+            PushChildren(*element, stack);
+            while (!stack.empty()) {
+                HtmlElement *it = NextInPreorder(stack);
+                if(it->HasClassNames(class_name)){
+                    result.push_back(it->shared_from_this());
                 }
-                if(iter == class_name.end()){
-                    result.push_back(*it);
-                }
-                GetElementByClassName(*it, name, result);
             }
         }
 
+        /**
+         * true if every name in class_name is one of this element's classes.
+         */
+        bool HasClassNames(const std::set<std::string> &class_name) const {
+            ParseAttribute();
+            return std::includes(class_names.begin(), class_names.end(), class_name.begin(), class_name.end());
+        }
+
         static void GetElementByTagName(const shared_ptr<HtmlElement> &element, const std::string &name, std::vector<shared_ptr<HtmlElement> > &result) {
-            for (HtmlElement::ChildIterator it = element->children.begin(); it != element->children.end(); ++it) {
-                if ((*it)->name == name)
-                    result.push_back(*it);
-                GetElementByTagName(*it, name, result);
+            std::vector<HtmlElement *> stack;
+            PushChildren(*element, stack);
+            while (!stack.empty()) {
+                HtmlElement *it = NextInPreorder(stack);
+                if (it->name == name)
+                    result.push_back(it->shared_from_this());
             }
         }
 
-        void Parse(const std::string &attr) {
-            size_t index = 0;
+        /**
+         * tokenize attributes straight from the parser input.
+         * plain runs are copied into k and v with a single append each.
+         * @param data parser input
+         * @param index first byte after the tag name
+         * @param length input length
+         * @param diagnostics receives warnings, may be NULL
+         * @return index of the closing '>' ('/' of a "/>" is not an attribute byte), or length
+         */
+        size_t Parse(const char *data, size_t index, size_t length, std::vector<HtmlDiagnostic> *diagnostics) const {
             std::string k;
             std::string v;
             char split = ' ';
@@ -224,13 +475,19 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
                 PARSE_ATTR_VALUE_END
             };
             ParseAttrState state = PARSE_ATTR_KEY;
-            while (attr.size() > index) {
-                char input = attr.at(index);
+            while (length > index) {
+                char input = data[index];
+                if (input == '>' || (input == '/' && index + 1 < length && data[index + 1] == '>')) {
+                    break;
+                }
                 switch (state) {
                     case PARSE_ATTR_KEY: {
                         if (input == '\t' || input == '\r' || input == '\n') {
                         } else if (input == '\'' || input == '"') {
-                            std::cerr << "WARN : attribute unexpected " << input << std::endl;
+                            if (diagnostics) {
+                                HtmlDiagnostic diagnostic = { HTML_ATTRIBUTE_UNEXPECTED_QUOTE, index, std::string(1, input) };
+                                diagnostics->push_back(diagnostic);
+                            }
                         } else if (input == ' ') {
                             if (!k.empty()) {
                                 attribute[k] = v;
@@ -239,7 +496,13 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
                         } else if (input == '=') {
                             state = PARSE_ATTR_VALUE_BEGIN;
                         } else {
-                            k.append(attr.c_str() + index, 1);
+                            size_t end = index + 1;
+                            while (end < length && !IsAttrKeyDelimiter(data[end])) {
+                                end++;
+                            }
+                            k.append(data + index, end - index);
+                            index = end;
+                            continue;
                         }
                     } break;
                     case PARSE_ATTR_VALUE_BEGIN:{
@@ -254,7 +517,7 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
                             quota = true;
                             state = PARSE_ATTR_VALUE_END;
                         } else {
-                            v.append(attr.c_str() + index, 1);
+                            v.append(data + index, 1);
                             quota = false;
                             state = PARSE_ATTR_VALUE_END;
                         }
@@ -266,7 +529,13 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
                             v.clear();
                             state = PARSE_ATTR_KEY;
                         } else {
-                            v.append(attr.c_str() + index, 1);
+                            size_t end = index + 1;
+                            while (end < length && !IsAttrValueDelimiter(data[end], quota, split)) {
+                                end++;
+                            }
+                            v.append(data + index, end - index);
+                            index = end;
+                            continue;
                         }
                     } break;
                 }
@@ -276,56 +545,467 @@ class HtmlElement : public enable_shared_from_this<HtmlElement> {
             if(!k.empty()){
                 attribute[k] = v;
             }
-            //trim
+            AttributeIterator it = attribute.find("class");
+            if (it != attribute.end()) {
+                class_names = SplitClassName(it->second);
+            }
+            return index;
+        }
+
+        /**
+         * find the end of the attributes the same way Parse does, the first
+         * '>' even inside quotes, but only keep the raw bytes. they are
+         * tokenized by ParseAttribute the first time they are read.
+         * @return index of the closing '>' ('/' of a "/>" is not an attribute byte), or length
+         */
+        size_t Scan(const char *data, size_t index, size_t length) {
+            if (length <= index) {
+                return index;
+            }
+            const char *close = static_cast<const char *>(memchr(data + index, '>', length - index));
+            size_t end = close ? close - data : length;
+            if (close && end > index && data[end - 1] == '/') {
+                end--;
+            }
+            raw_attribute.assign(data + index, end - index);
+            return end;
+        }
+
+        /**
+         * tokenize the bytes kept by Scan, attribute and class_names
+         * are only valid after this. it writes the element, so readers on
+         * other threads need HtmlDocument::Freeze first.
+         */
+        void ParseAttribute() const {
+            if (!raw_attribute.empty()) {
+                std::string raw;
+                raw.swap(raw_attribute);
+                Parse(raw.data(), 0, raw.size(), NULL);
+            }
+        }
+
+        static bool IsAttrKeyDelimiter(char c) {
+            return c == '\t' || c == '\r' || c == '\n' || c == ' ' || c == '\'' || c == '"' || c == '=' || c == '>' || c == '/';
+        }
+
+        static bool IsAttrValueDelimiter(char c, bool quota, char split) {
+            if (c == '>' || c == '/') {
+                return true;
+            }
+            return quota ? c == split : (c == '\t' || c == '\r' || c == '\n' || c == ' ');
+        }
+
+        void Trim() {
             if (!value.empty()) {
                 value.erase(0, value.find_first_not_of(" "));
                 value.erase(value.find_last_not_of(" ") + 1);
             }
         }
+
+        /**
+         * take over element as the last child, element is left empty.
+         */
+        void AddChild(shared_ptr<HtmlElement> &element) {
+            element->index = children.size();
+            children.push_back(shared_ptr<HtmlElement>());
+            children.back().swap(element);
+        }
+
         static std::set<std::string> SplitClassName(const std::string& name){
-            #if defined(WIN32)
-                #define strtok_ strtok_s
-            #else
-                #define strtok_ strtok_r
-            #endif
             std::set<std::string> class_names;
-            char *temp = NULL;
-            char *p = strtok_((char *)name.c_str(), " ", &temp);
-            while (p) {
-                class_names.insert(p);
-                p = strtok_(NULL, " ", &temp);
+            size_t begin = name.find_first_not_of(' ');
+            while (begin != std::string::npos) {
+                size_t end = name.find(' ', begin);
+                class_names.insert(name.substr(begin, end - begin));
+                begin = name.find_first_not_of(' ', end);
             }
             return class_names;
         }
         std::string name;
         std::string value;
-        std::map<std::string, std::string> attribute;
-        weak_ptr<HtmlElement> parent;
+        mutable std::map<std::string, std::string> attribute; // see ParseAttribute
+        mutable std::set<std::string> class_names;
+        mutable std::string raw_attribute; // attribute bytes not tokenized yet
+        HtmlElement *parent; // non-owning, the parent owns this element through children
         std::vector<shared_ptr<HtmlElement> > children;
+        size_t index; // position in parent->children
 };
 
+/**
+ * class HtmlSelector
+ * selector compiled once by parse_selector and reusable across queries
+ */
+class HtmlSelector {
+    public:
+        explicit HtmlSelector(const std::string &selector) : selectors_(parse_selector(selector)) {}
+
+        /**
+         * false if the selector failed to compile, it then matches nothing.
+         */
+        bool IsValid() const {
+            return !selectors_.empty();
+        }
+
+        /**
+         * match descendants of scope in a single preorder pass.
+         * each candidate is matched right-to-left against the path of
+         * its ancestors, so combinators never re-walk the tree.
+         */
+        std::vector<shared_ptr<HtmlElement> > Select(const shared_ptr<HtmlElement> &scope) const {
+            std::vector<shared_ptr<HtmlElement> > result;
+            if (selectors_.empty()) {
+                return result;
+            }
+
+            std::vector<const HtmlElement *> path;
+            std::vector<size_t> searched;
+            for (const HtmlElement *p = scope.get(); p && p->parent; p = p->parent) {
+                path.push_back(p);
+            }
+            std::reverse(path.begin(), path.end());
+
+            // element and the depth of its parent in path
+            std::vector<std::pair<HtmlElement *, size_t> > stack;
+            for (std::vector<shared_ptr<HtmlElement> >::const_reverse_iterator it = scope->children.rbegin(); it != scope->children.rend(); ++it) {
+                stack.push_back(std::make_pair(it->get(), path.size()));
+            }
+            while (!stack.empty()) {
+                HtmlElement *element = stack.back().first;
+                size_t depth = stack.back().second;
+                stack.pop_back();
+
+                path.resize(depth);
+                if (Match(*element, path, searched)) {
+                    result.push_back(element->shared_from_this());
+                }
+                path.push_back(element);
+                for (std::vector<shared_ptr<HtmlElement> >::const_reverse_iterator it = element->children.rbegin(); it != element->children.rend(); ++it) {
+                    stack.push_back(std::make_pair(it->get(), depth + 1));
+                }
+            }
+            return result;
+        }
+
+        /**
+         * @param path ancestors of element, outermost first
+         */
+        bool Match(const HtmlElement &element, const std::vector<const HtmlElement *> &path) const {
+            std::vector<size_t> searched;
+            return Match(element, path, searched);
+        }
+
+    private:
+        /**
+         * @param searched scratch space, reused across candidates by Select
+         */
+        bool Match(const HtmlElement &element, const std::vector<const HtmlElement *> &path, std::vector<size_t> &searched) const {
+            for (simple_selector::const_iterator it = selectors_.begin(); it != selectors_.end(); ++it) {
+                if (MatchQuery(*it, it->size() - 1, element, path, path.size(), searched)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * searched[pos] is the depth below which a descendant combinator of
+         * query[pos] already found no match for query[pos - 1]. whether an
+         * ancestor matches query[0..pos - 1] only depends on the path above it,
+         * so later searches stop there and each (pos, depth) pair is tried at
+         * most once: matching is linear in compounds times depth, where plain
+         * backtracking is exponential in the number of compounds.
+         */
+        static bool MatchQuery(const query_t &query, size_t pos, const HtmlElement &element, const std::vector<const HtmlElement *> &path, size_t depth, std::vector<size_t> &searched) {
+            if (!MatchCompound(query[pos], element)) {
+                return false;
+            }
+            if (pos == 0) {
+                return true;
+            }
+            if (pos + 1 == query.size()) {
+                // the candidate itself, nothing searched for it yet
+                searched.assign(query.size(), 0);
+            }
+            if (query[pos].combinator == '>') {
+                return depth > 0 && MatchQuery(query, pos - 1, *path[depth - 1], path, depth - 1, searched);
+            }
+            for (size_t i = depth; i > searched[pos]; i--) {
+                if (MatchQuery(query, pos - 1, *path[i - 1], path, i - 1, searched)) {
+                    return true;
+                }
+            }
+            searched[pos] = std::max(searched[pos], depth);
+            return false;
+        }
+
+        static bool MatchCompound(const selector_t &compound, const HtmlElement &element) {
+            if (!compound.tag.empty() && compound.tag != element.name) {
+                return false;
+            }
+            element.ParseAttribute();
+            if (!compound.id.empty()) {
+                HtmlElement::AttributeIterator it = element.attribute.find("id");
+                if (it == element.attribute.end() || it->second != compound.id) {
+                    return false;
+                }
+            }
+            if (!compound.classes.empty() && !element.HasClassNames(compound.classes)) {
+                return false;
+            }
+            for (std::vector<selector_attr_t>::const_iterator it = compound.attrs.begin(); it != compound.attrs.end(); ++it) {
+                HtmlElement::AttributeIterator attr = element.attribute.find(it->key);
+                if (attr == element.attribute.end()) {
+                    if (it->exp == "!=") {
+                        continue;
+                    }
+                    return false;
+                }
+                if (!MatchAttribute(*it, attr->second)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static bool MatchAttribute(const selector_attr_t &cond, const std::string &value) {
+            const std::string &exp = cond.exp;
+            const std::string &val = cond.val;
+            if (exp.empty()) {
+                return true;
+            } else if (exp == "=") {
+                return value == val;
+            } else if (exp == "!=") {
+                return value != val;
+            } else if (exp == "^=") {
+                return !val.empty() && value.compare(0, val.size(), val) == 0;
+            } else if (exp == "$=") {
+                return !val.empty() && value.size() >= val.size() && value.compare(value.size() - val.size(), val.size(), val) == 0;
+            } else if (exp == "*=") {
+                return !val.empty() && value.find(val) != std::string::npos;
+            } else if (exp == "|=") {
+                return value == val || (value.size() > val.size() && value.compare(0, val.size(), val) == 0 && value[val.size()] == '-');
+            } else if (exp == "~=") {
+                return !val.empty() && HtmlElement::SplitClassName(value).count(val) > 0;
+            }
+            return false;
+        }
+
+        simple_selector selectors_;
+};
+
+inline std::vector<shared_ptr<HtmlElement> > HtmlElement::find(const std::string &selector) {
+    return HtmlSelector(selector).Select(shared_from_this());
+}
+
+inline std::vector<shared_ptr<HtmlElement> > HtmlElement::find(const HtmlSelector &selector) {
+    return selector.Select(shared_from_this());
+}
+
 /**
  * class HtmlDocument
  * Html Doc struct
+ * attributes are tokenized and the id/class/tag indexes built on first use,
+ * so even the read-only lookups write to the document until Freeze is called.
  */
 class HtmlDocument {
     public:
-        HtmlDocument(shared_ptr<HtmlElement> &root) : root_(root) {}
+        HtmlDocument(shared_ptr<HtmlElement> &root) : root_(root), indexed_(false) {}
         shared_ptr<HtmlElement> GetElementById(const std::string &id) {
-            return HtmlElement::GetElementById(root_, id);
+            if (id.empty()) {
+                return HtmlElement::GetElementById(root_, id);
+            }
+            BuildIndex();
+            IdIndex::const_iterator it = id_index_.find(id);
+            if (it == id_index_.end()) {
+                return shared_ptr<HtmlElement>();
+            }
+            return it->second;
         }
         std::vector<shared_ptr<HtmlElement> > GetElementByClassName(const std::string &name) {
             std::vector<shared_ptr<HtmlElement> > result;
-            HtmlElement::GetElementByClassName(root_, name, result);
+            std::set<std::string> class_name = HtmlElement::SplitClassName(name);
+            if (class_name.empty()) {
+                HtmlElement::GetElementByClassName(root_, class_name, result);
+                return result;
+            }
+            BuildIndex();
+            // walk the shortest posting list and check the remaining classes per element
+            const std::vector<shared_ptr<HtmlElement> > *candidates = NULL;
+            for (std::set<std::string>::const_iterator it = class_name.begin(); it != class_name.end(); ++it) {
+                ElementIndex::const_iterator found = class_index_.find(*it);
+                if (found == class_index_.end()) {
+                    return result;
+                }
+                if (!candidates || found->second.size() < candidates->size()) {
+                    candidates = &found->second;
+                }
+            }
+            if (class_name.size() == 1) {
+                return *candidates;
+            }
+            for (HtmlElement::ChildIterator it = candidates->begin(); it != candidates->end(); ++it) {
+                if ((*it)->HasClassNames(class_name)) {
+                    result.push_back(*it);
+                }
+            }
             return result;
         }
+        std::vector<shared_ptr<HtmlElement> > find(const std::string &selector) {
+            return HtmlSelector(selector).Select(root_);
+        }
+        std::vector<shared_ptr<HtmlElement> > find(const HtmlSelector &selector) {
+            return selector.Select(root_);
+        }
         std::vector<shared_ptr<HtmlElement> > GetElementByTagName(const std::string &name) {
-            std::vector<shared_ptr<HtmlElement> > result;
-            HtmlElement::GetElementByTagName(root_, name, result);
-            return result;
+            BuildIndex();
+            ElementIndex::const_iterator it = tag_index_.find(name);
+            if (it == tag_index_.end()) {
+                return std::vector<shared_ptr<HtmlElement> >();
+            }
+            return it->second;
+        }
+        /**
+         * tokenize every attribute and build the indexes now instead of on
+         * first use. call it once before GetAttribute, AttributeBegin/End,
+         * find or GetElementBy* run on more than one thread, afterwards they
+         * only read. the document must not be modified.
+         */
+        void Freeze() {
+            root_->ParseAttribute();
+            BuildIndex();
+        }
+        /**
+         * estimate the memory held by the document, elements handed out
+         * and still referenced elsewhere are counted as long as they are in the tree.
+         */
+        HtmlMemoryUsage MemoryUsage() const {
+            HtmlMemoryUsage usage = { 0, 0, 0, 0, 0 };
+            std::vector<HtmlElement *> stack(1, root_.get());
+            while (!stack.empty()) {
+                HtmlElement *element = HtmlElement::NextInPreorder(stack);
+                // the element and a separately allocated shared_ptr control block
+                usage.nodes += sizeof(HtmlElement) + 3 * sizeof(void *);
+                usage.strings += StringBytes(element->name) + StringBytes(element->value);
+                usage.attributes += StringBytes(element->raw_attribute);
+                for (HtmlElement::AttributeIterator it = element->attribute.begin(); it != element->attribute.end(); ++it) {
+                    usage.attributes += TreeNodeBytes(sizeof(*it)) + StringBytes(it->first) + StringBytes(it->second);
+                }
+                for (std::set<std::string>::const_iterator it = element->class_names.begin(); it != element->class_names.end(); ++it) {
+                    usage.attributes += TreeNodeBytes(sizeof(*it)) + StringBytes(*it);
+                }
+                usage.children += element->children.capacity() * sizeof(shared_ptr<HtmlElement>);
+            }
+            usage.indexes += id_index_.bucket_count() * sizeof(void *);
+            for (IdIndex::const_iterator it = id_index_.begin(); it != id_index_.end(); ++it) {
+                usage.indexes += HashNodeBytes(sizeof(*it)) + StringBytes(it->first);
+            }
+            usage.indexes += IndexBytes(class_index_) + IndexBytes(tag_index_);
+            return usage;
+        }
+        /**
+         * give excess capacity back to the allocator once the document is built:
+         * child vectors, text values and decoded attributes grow by appending
+         * and may hold up to twice the memory they use. attributes that are
+         * not tokenized yet stay that way.
+         */
+        void Compact() {
+            std::vector<HtmlElement *> stack(1, root_.get());
+            while (!stack.empty()) {
+                HtmlElement *element = HtmlElement::NextInPreorder(stack);
+                std::string(element->name).swap(element->name);
+                std::string(element->value).swap(element->value);
+                if (!element->attribute.empty()) {
+                    std::map<std::string, std::string>(element->attribute).swap(element->attribute);
+                }
+                std::vector<shared_ptr<HtmlElement> >(element->children).swap(element->children);
+            }
+            for (ElementIndex::iterator it = class_index_.begin(); it != class_index_.end(); ++it) {
+                std::vector<shared_ptr<HtmlElement> >(it->second).swap(it->second);
+            }
+            for (ElementIndex::iterator it = tag_index_.begin(); it != tag_index_.end(); ++it) {
+                std::vector<shared_ptr<HtmlElement> >(it->second).swap(it->second);
+            }
+            // the smallest bucket count that keeps the load factor
+            id_index_.rehash(0);
+            class_index_.rehash(0);
+            tag_index_.rehash(0);
         }
     private:
+        /**
+         * lookups only ever ask for one exact key, so the indexes are hashed;
+         * posting lists are vectors in document order.
+         */
+        typedef unordered_map<std::string, shared_ptr<HtmlElement> > IdIndex;
+        typedef unordered_map<std::string, std::vector<shared_ptr<HtmlElement> > > ElementIndex;
+
+        /**
+         * heap bytes of a string, 0 while it lives in the small string buffer.
+         */
+        static size_t StringBytes(const std::string &s) {
+            std::less<const char *> less;
+            const char *self = reinterpret_cast<const char *>(&s);
+            if (!less(s.data(), self) && less(s.data(), self + sizeof(s))) {
+                return 0;
+            }
+            return s.capacity() + 1;
+        }
+
+        /**
+         * one red-black tree node: the value plus three links and the color.
+         */
+        static size_t TreeNodeBytes(size_t value_size) {
+            return value_size + 4 * sizeof(void *);
+        }
+
+        /**
+         * one hash table node: the value, the next link and the cached hash.
+         */
+        static size_t HashNodeBytes(size_t value_size) {
+            return value_size + 2 * sizeof(void *);
+        }
+
+        static size_t IndexBytes(const ElementIndex &index) {
+            size_t bytes = index.bucket_count() * sizeof(void *);
+            for (ElementIndex::const_iterator it = index.begin(); it != index.end(); ++it) {
+                bytes += HashNodeBytes(sizeof(*it)) + StringBytes(it->first) + it->second.capacity() * sizeof(shared_ptr<HtmlElement>);
+            }
+            return bytes;
+        }
+
+        /**
+         * fill the id/class/tag indexes in one preorder pass,
+         * so every posting list is in document order.
+         * built on the first lookup or by Freeze, a document only queried
+         * through find never tokenizes attributes the selectors don't look at.
+         */
+        void BuildIndex() {
+            if (indexed_) {
+                return;
+            }
+            indexed_ = true;
+            std::vector<HtmlElement *> stack;
+            HtmlElement::PushChildren(*root_, stack);
+            while (!stack.empty()) {
+                HtmlElement *element = HtmlElement::NextInPreorder(stack);
+                shared_ptr<HtmlElement> self = element->shared_from_this();
+
+                tag_index_[element->name].push_back(self);
+                element->ParseAttribute();
+                HtmlElement::AttributeIterator id = element->attribute.find("id");
+                if (id != element->attribute.end() && !id->second.empty()) {
+                    id_index_.insert(std::make_pair(id->second, self));
+                }
+                for (std::set<std::string>::const_iterator it = element->class_names.begin(); it != element->class_names.end(); ++it) {
+                    class_index_[*it].push_back(self);
+                }
+            }
+        }
+
         shared_ptr<HtmlElement> root_;
+        IdIndex id_index_;
+        ElementIndex class_index_;
+        ElementIndex tag_index_;
+        bool indexed_;
 };
 
 /**
@@ -334,7 +1014,7 @@ class HtmlDocument {
  */
 class HtmlParser {
     public:
-        HtmlParser() {
+        HtmlParser() : diagnostics_(NULL) {
             static const std::string token[] = { "br", "hr", "img", "input", "link", "meta", "area", "base", "col", "command", "embed", "keygen", "param", "source", "track", "wbr"};
             self_closing_tags_.insert(token, token + sizeof(token) / sizeof(token[0]));
         }
@@ -342,11 +1022,13 @@ class HtmlParser {
          * parse html by C-Style data
          * @param data
          * @param len
+         * @param diagnostics if not NULL, parse warnings are appended to it
          * @return html document object
          */
-        shared_ptr<HtmlDocument> Parse(const char *data, size_t len) {
+        shared_ptr<HtmlDocument> Parse(const char *data, size_t len, std::vector<HtmlDiagnostic> *diagnostics = NULL) {
             stream_ = data;
             length_ = len;
+            diagnostics_ = diagnostics;
             size_t index = 0;
             root_.reset(new HtmlElement());
             while (length_ > index) {
@@ -364,167 +1046,260 @@ class HtmlParser {
         /**
          * parse html by string data
          * @param data
+         * @param diagnostics if not NULL, parse warnings are appended to it
          * @return html document object
          */
-        shared_ptr<HtmlDocument> Parse(const std::string &data) {
-            return Parse(data.data(), data.size());
+        shared_ptr<HtmlDocument> Parse(const std::string &data, std::vector<HtmlDiagnostic> *diagnostics = NULL) {
+            return Parse(data.data(), data.size(), diagnostics);
         }
     private:
+        enum ParseElementState {
+            PARSE_ELEMENT_TAG,
+            PARSE_ELEMENT_ATTR,
+            PARSE_ELEMENT_VALUE,
+            PARSE_ELEMENT_TAG_END
+        };
+
+        struct OpenElement {
+            shared_ptr<HtmlElement> self;
+            ParseElementState state;
+        };
+
+        /**
+         * build the element starting at index and all of its descendants.
+         * open elements live on an explicit stack instead of the call stack,
+         * so nesting depth is bounded only by memory.
+         * an element is attached to its parent only once it is closed,
+         * elements left open by a mismatched close tag or EOF are dropped.
+         * @return index after the element
+         */
         size_t ParseElement(size_t index, shared_ptr<HtmlElement> &element) {
-            while (length_ > index) {
-                char input = stream_[index + 1];
-                if (input == '!') {
-                    if (strncmp(stream_ + index, "<!--", 4) == 0) {
-                        return SkipUntil(index + 2, "-->");
+            std::vector<OpenElement> open;
+            bool start = true;  // index is at the '<' of a new element
+
+            while (true) {
+                const shared_ptr<HtmlElement> &parent = open.size() > 1 ? open[open.size() - 2].self : element;
+
+                if (start) {
+                    start = false;
+                    const shared_ptr<HtmlElement> &owner = open.empty() ? element : open.back().self;
+                    char input = index + 1 < length_ ? stream_[index + 1] : 0;
+                    if (input == '!') {
+                        if (length_ >= index + 4 && memcmp(stream_ + index, "<!--", 4) == 0) {
+                            index = SkipUntil(index + 2, "-->");
+                        } else {
+                            index = SkipUntil(index + 2, '>');
+                        }
+                    } else if (input == '/') {
+                        index = SkipUntil(index, '>');
+                    } else if (input == '?') {
+                        index = SkipUntil(index, "?>");
                     } else {
-                        return SkipUntil(index + 2, '>');
+                        HtmlElement *created = new HtmlElement(owner);
+                        open.push_back(OpenElement());
+                        open.back().self.reset(created);
+                        open.back().state = PARSE_ELEMENT_TAG;
+                        index++;
                     }
-                } else if (input == '/') {
-                    return SkipUntil(index, '>');
-                } else if (input == '?') {
-                    return SkipUntil(index, "?>");
-                }
-                shared_ptr<HtmlElement> self(new HtmlElement(element));
-                enum ParseElementState {
-                    PARSE_ELEMENT_TAG,
-                    PARSE_ELEMENT_ATTR,
-                    PARSE_ELEMENT_VALUE,
-                    PARSE_ELEMENT_TAG_END
-                };
-
-                ParseElementState state = PARSE_ELEMENT_TAG;
-                index++;
-                char split = 0;
-                std::string attr;
-
-                while (length_ > index) {
-                    switch (state) {
-                        case PARSE_ELEMENT_TAG: {
-                            char input = stream_[index];
-                            if (input == ' ' || input == '\r' || input == '\n' || input == '\t') {
-                                if (!self->name.empty()) {
-                                    state = PARSE_ELEMENT_ATTR;
-                                }
-                                index++;
-                            } else if (input == '/') {
-                                self->Parse(attr);
-                                element->children.push_back(self);
-                                return SkipUntil(index, '>');
-                            } else if (input == '>') {
-                                if(self_closing_tags_.find(self->name) != self_closing_tags_.end()) {
-                                    element->children.push_back(self);
-                                    return ++index;
-                                }
-                                state = PARSE_ELEMENT_VALUE;
-                                index++;
+                    if (open.empty()) {
+                        return index;
+                    }
+                    continue;
+                }
+
+                if (length_ <= index) {
+                    return index;
+                }
+
+                shared_ptr<HtmlElement> &self = open.back().self;
+                ParseElementState &state = open.back().state;
+                bool closed = false;  // self is done, index is past it
+
+                switch (state) {
+                    case PARSE_ELEMENT_TAG: {
+                        char input = stream_[index];
+                        if (input == ' ' || input == '\r' || input == '\n' || input == '\t') {
+                            if (!self->name.empty()) {
+                                state = PARSE_ELEMENT_ATTR;
+                            }
+                            index++;
+                        } else if (input == '/') {
+                            parent->AddChild(self);
+                            index = SkipUntil(index, '>');
+                            closed = true;
+                        } else if (input == '>') {
+                            if(self_closing_tags_.find(self->name) != self_closing_tags_.end()) {
+                                parent->AddChild(self);
+                                ++index;
+                                closed = true;
                             } else {
-                                self->name.append(stream_ + index, 1);
+                                state = PARSE_ELEMENT_VALUE;
                                 index++;
                             }
-                        } break;
-                        case PARSE_ELEMENT_ATTR: {
-                            char input = stream_[index];
-                            if (input == '>') {
-                                if (stream_[index - 1] == '/') {
-                                    attr.erase(attr.size() - 1);
-                                    self->Parse(attr);
-                                    element->children.push_back(self);
-                                    return ++index;
-                                } else if(self_closing_tags_.find(self->name) != self_closing_tags_.end()) {
-                                    self->Parse(attr);
-                                    element->children.push_back(self);
-                                    return ++index;
-                                }
-                                state = PARSE_ELEMENT_VALUE;
+                        } else {
+                            size_t begin = index++;
+                            while (length_ > index && !IsTagNameDelimiter(stream_[index])) {
                                 index++;
+                            }
+                            self->name.append(stream_ + begin, index - begin);
+                        }
+                    } break;
+                    case PARSE_ELEMENT_ATTR: {
+                        // quote warnings need the attributes tokenized now, otherwise defer it
+                        index = diagnostics_ ? self->Parse(stream_, index, length_, diagnostics_) : self->Scan(stream_, index, length_);
+                        if (length_ > index && stream_[index] == '/') {
+                            parent->AddChild(self);
+                            index += 2;
+                            closed = true;
+                        } else if (length_ > index) {
+                            if(self_closing_tags_.find(self->name) != self_closing_tags_.end()) {
+                                parent->AddChild(self);
+                                ++index;
+                                closed = true;
                             } else {
-                                attr.append(stream_ + index, 1);
+                                state = PARSE_ELEMENT_VALUE;
                                 index++;
                             }
-                        } break;
-                        case PARSE_ELEMENT_VALUE: {
-                            if (self->name == "script" || self->name == "noscript" || self->name == "style") {
-                                std::string close = "</" + self->name + ">";
-                                size_t pre = index;
-                                index = SkipUntil(index, close.c_str());
-                                if (index > (pre + close.size()))
-                                    self->value.append(stream_ + pre, index - pre - close.size());
-                                self->Parse(attr);
-                                element->children.push_back(self);
-                                return index;
-                            }
-                            char input = stream_[index];
-                            if (input == '<') {
-                                if (stream_[index + 1] == '/') {
-                                    state = PARSE_ELEMENT_TAG_END;
-                                } else {
-                                    index = ParseElement(index, self);
-                                }
-                            } else if (input != '\r' && input != '\n' && input != '\t') {
-                                self->value.append(stream_ + index, 1);
-                                index++;
+                        }
+                    } break;
+                    case PARSE_ELEMENT_VALUE: {
+                        if (self->name == "script" || self->name == "noscript" || self->name == "style") {
+                            std::string close = "</" + self->name + ">";
+                            size_t pre = index;
+                            index = SkipUntil(index, close.c_str());
+                            if (index > (pre + close.size()))
+                                self->value.append(stream_ + pre, index - pre - close.size());
+                            self->Trim();
+                            parent->AddChild(self);
+                            closed = true;
+                            break;
+                        }
+                        char input = stream_[index];
+                        if (input == '<') {
+                            if (index + 1 < length_ && stream_[index + 1] == '/') {
+                                state = PARSE_ELEMENT_TAG_END;
                             } else {
+                                start = true;
+                            }
+                        } else if (input != '\r' && input != '\n' && input != '\t') {
+                            size_t begin = index++;
+                            while (length_ > index && !IsTextDelimiter(stream_[index])) {
                                 index++;
                             }
-                        } break;
-                        case PARSE_ELEMENT_TAG_END: {
-                            index += 2;
-                            std::string selfname = self->name + ">";
-                            if (strncmp(stream_ + index, selfname.c_str(), selfname.size())) {
-                                int pre = index;
-                                index = SkipUntil(index, ">");
-                                std::string value;
-                                if (index > (pre + 1))
-                                    value.append(stream_ + pre, index - pre - 1);
-                                else
-                                    value.append(stream_ + pre, index - pre);
-                                shared_ptr<HtmlElement> parent = self->GetParent();
-                                while (parent) {
-                                    if (parent->name == value) {
-                                        std::cerr << "WARN : element not closed <" << self->name << "> " << std::endl;
-                                        return pre - 2;
-                                    }
-                                    parent = parent->GetParent();
-                                }
-                                std::cerr << "WARN : unexpected closed element </" << value << "> for <" << self->name
-                                          << ">" << std::endl;
-                                state = PARSE_ELEMENT_VALUE;
+                            self->value.append(stream_ + begin, index - begin);
+                        } else {
+                            index++;
+                        }
+                    } break;
+                    case PARSE_ELEMENT_TAG_END: {
+                        index += 2;
+                        std::string selfname = self->name + ">";
+                        if (length_ < index + selfname.size() || memcmp(stream_ + index, selfname.data(), selfname.size())) {
+                            size_t pre = index;
+                            index = SkipUntil(index, ">");
+                            std::string value;
+                            if (index > (pre + 1))
+                                value.append(stream_ + pre, index - pre - 1);
+                            else
+                                value.append(stream_ + pre, index - pre);
+                            if (IsOpen(open, element, value)) {
+                                // let the ancestor consume its close tag
+                                Report(HTML_ELEMENT_NOT_CLOSED, pre - 2, self->name);
+                                index = pre - 2;
+                                closed = true;
                             } else {
-                                self->Parse(attr);
-                                element->children.push_back(self);
-                                return SkipUntil(index, '>');
+                                Report(HTML_UNEXPECTED_CLOSE_TAG, pre - 2, value);
+                                state = PARSE_ELEMENT_VALUE;
                             }
-                        } break;
+                        } else {
+                            self->Trim();
+                            parent->AddChild(self);
+                            index = SkipUntil(index, '>');
+                            closed = true;
+                        }
+                    } break;
+                }
+
+                if (closed) {
+                    open.pop_back();
+                    if (open.empty()) {
+                        return index;
                     }
                 }
             }
-            return index;
         }
 
+        /**
+         * true if an ancestor of the innermost open element is named name.
+         */
+        static bool IsOpen(const std::vector<OpenElement> &open, const shared_ptr<HtmlElement> &element, const std::string &name) {
+            for (size_t i = open.size() - 1; i > 0; i--) {
+                if (open[i - 1].self->name == name) {
+                    return true;
+                }
+            }
+            for (const HtmlElement *parent = element.get(); parent; parent = parent->parent) {
+                if (parent->name == name) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static bool IsTagNameDelimiter(char c) {
+            return c == ' ' || c == '\r' || c == '\n' || c == '\t' || c == '/' || c == '>';
+        }
+
+        static bool IsTextDelimiter(char c) {
+            return c == '<' || c == '\r' || c == '\n' || c == '\t';
+        }
+
+        /**
+         * skip past the next occurrence of data.
+         * candidates are located with memchr on the first byte and then
+         * verified with memcmp, so the scan never leaves [index, length_).
+         * @return index just past the match, or length_ if not found
+         */
         size_t SkipUntil(size_t index, const char *data) {
-            while (length_ > index) {
-                if (strncmp(stream_ + index, data, strlen(data)) == 0) {
-                    return index + strlen(data);
-                } else {
-                    index++;
+            const size_t size = strlen(data);
+            if (size == 0) {
+                return index;
+            }
+            while (length_ >= index + size) {
+                const char *p = static_cast<const char *>(memchr(stream_ + index, data[0], length_ - index - size + 1));
+                if (!p) {
+                    break;
+                }
+                index = p - stream_;
+                if (memcmp(p + 1, data + 1, size - 1) == 0) {
+                    return index + size;
                 }
+                index++;
             }
-            return index;
+            return index > length_ ? index : length_;
         }
 
         size_t SkipUntil(size_t index, const char data) {
-            while (length_ > index) {
-                if (stream_[index] == data) {
-                    return ++index;
-                } else {
-                    index++;
+            if (length_ > index) {
+                const char *p = static_cast<const char *>(memchr(stream_ + index, data, length_ - index));
+                if (p) {
+                    return p - stream_ + 1;
                 }
+                return length_;
             }
             return index;
         }
+    private:
+        void Report(HtmlDiagnosticCode code, size_t offset, const std::string &name) {
+            if (diagnostics_) {
+                HtmlDiagnostic diagnostic = { code, offset, name };
+                diagnostics_->push_back(diagnostic);
+            }
+        }
     private:
         const char *stream_;
         size_t length_;
+        std::vector<HtmlDiagnostic> *diagnostics_;
         std::set<std::string> self_closing_tags_;
         shared_ptr<HtmlElement> root_;
 };
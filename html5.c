@@ -8,61 +8,87 @@
 #define wcsncasecmp(a,b,l) lstrcmpiW(a,b)
 #endif
 
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cstdint>
+#include <cwctype>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
 #include <boost/regex.hpp>
-#include <boost/lexical_cast.hpp>
 
 template<typename CharType> const CharType* comment_tag_string();
 template<> const char* comment_tag_string<char>(){ return "<!--"; }
 template<> const wchar_t* comment_tag_string<wchar_t>(){ return L"<!--"; }
+template<> const char16_t* comment_tag_string<char16_t>(){ return u"<!--"; }
 
 template<typename CharType> const CharType* id_tag_string();
 template<> const char* id_tag_string<char>(){ return "id"; }
 template<> const wchar_t* id_tag_string<wchar_t>(){ return L"id"; }
+template<> const char16_t* id_tag_string<char16_t>(){ return u"id"; }
 
 template<typename CharType> const CharType* class_tag_string();
 template<> const char* class_tag_string<char>(){ return "class"; }
 template<> const wchar_t* class_tag_string<wchar_t>(){ return L"class"; }
+template<> const char16_t* class_tag_string<char16_t>(){ return u"class"; }
 
 template<typename CharType> const CharType* script_tag_string();
 template<> const char* script_tag_string<char>(){ return "script"; }
 template<> const wchar_t* script_tag_string<wchar_t>(){ return L"script"; }
+template<> const char16_t* script_tag_string<char16_t>(){ return u"script"; }
 
 
 template<typename CharType> const CharType* operator_string_contain();
 template<> const char* operator_string_contain<char>(){ return "$="; }
 template<> const wchar_t* operator_string_contain<wchar_t>(){ return L"$="; }
+template<> const char16_t* operator_string_contain<char16_t>(){ return u"$="; }
 
 template<typename CharType> const CharType* operator_string_inequalityt();
 template<> const char* operator_string_inequalityt<char>(){ return "!="; }
 template<> const wchar_t* operator_string_inequalityt<wchar_t>(){ return L"!="; }
+template<> const char16_t* operator_string_inequalityt<char16_t>(){ return u"!="; }
 
 template<typename CharType> const CharType* operator_string_equalityt();
 template<> const char* operator_string_equalityt<char>(){ return "="; }
 template<> const wchar_t* operator_string_equalityt<wchar_t>(){ return L"="; }
+template<> const char16_t* operator_string_equalityt<char16_t>(){ return u"="; }
 
 template<typename CharType> const CharType* selector_empty_string();
 template<> const char* selector_empty_string<char>(){ return "#"; }
 template<> const wchar_t* selector_empty_string<wchar_t>(){ return L"#"; }
+template<> const char16_t* selector_empty_string<char16_t>(){ return u"#"; }
 
 template<typename CharType> const CharType* operator_string_first();
 template<> const char* operator_string_first<char>(){ return "first"; }
 template<> const wchar_t* operator_string_first<wchar_t>(){ return L"first"; }
+template<> const char16_t* operator_string_first<char16_t>(){ return u"first"; }
 
 template<typename CharType> const CharType* operator_string_last();
 template<> const char* operator_string_last<char>(){ return "last"; }
 template<> const wchar_t* operator_string_last<wchar_t>(){ return L"last"; }
+template<> const char16_t* operator_string_last<char16_t>(){ return u"last"; }
 
 template<typename CharType> const CharType* string_eq();
 template<> const char* string_eq<char>(){ return "eq"; }
 template<> const wchar_t* string_eq<wchar_t>(){ return L"eq"; }
+template<> const char16_t* string_eq<char16_t>(){ return u"eq"; }
 
-template<typename CharType> const CharType* string_qt();
-template<> const char* string_qt<char>(){ return "qt"; }
-template<> const wchar_t* string_qt<wchar_t>(){ return L"qt"; }
+template<typename CharType> const CharType* string_gt();
+template<> const char* string_gt<char>(){ return "gt"; }
+template<> const wchar_t* string_gt<wchar_t>(){ return L"gt"; }
+template<> const char16_t* string_gt<char16_t>(){ return u"gt"; }
 
 template<typename CharType> const CharType* string_lt();
 template<> const char* string_lt<char>(){ return "lt"; }
 template<> const wchar_t* string_lt<wchar_t>(){ return L"lt"; }
+template<> const char16_t* string_lt<char16_t>(){ return u"lt"; }
 
 #include "html5.h"
 
@@ -82,6 +108,7 @@ html::basic_selector<CharType>::basic_selector(std::basic_string<CharType>&&s)
 
 template html::basic_selector<char>::basic_selector(std::basic_string<char>&&s);
 template html::basic_selector<wchar_t>::basic_selector(std::basic_string<wchar_t>&&s);
+template html::basic_selector<char16_t>::basic_selector(std::basic_string<char16_t>&&s);
 
 static bool strcmp_ignore_case(const std::string& a, const std::string& b)
 {
@@ -97,23 +124,40 @@ static bool strcmp_ignore_case(const std::wstring& a, const std::wstring& b)
 	return false;
 }
 
+static bool strcmp_ignore_case(const std::u16string& a, const std::u16string& b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (std::size_t i = 0; i < a.size(); i++)
+	{
+		if (html::detail::fold_case(a[i]) != html::detail::fold_case(b[i]))
+			return false;
+	}
+	return true;
+}
+
 template<typename CharType>
 void html::basic_selector<CharType>::build_matchers()
 {
 	selector_matcher matcher;
 
+	auto str_iterator = m_select_string.begin();
+
+	int state = 0;
+
 	if (m_select_string[0] == '*')
 	{
 		matcher.all_match = true;
 
-		m_matchers.push_back(matcher);
-		return;
+		// 之后只能跟位置伪类, 例如 *:first
+		if (m_select_string.size() < 2 || m_select_string[1] != ':')
+		{
+			m_matchers.push_back(matcher);
+			return;
+		}
+		++str_iterator;
 	}
 
-	auto str_iterator = m_select_string.begin();
-
-	int state = 0;
-
 	auto getc = [this, &str_iterator]() -> CharType {
 		if (str_iterator != m_select_string.end())
 			return *str_iterator++;
@@ -127,6 +171,35 @@ void html::basic_selector<CharType>::build_matchers()
 
 	std::basic_string<CharType> matcher_str;
 
+	// 结束 state 所示种类 (0 为 tag) 的名字, 加入当前一级
+	auto flush_condition = [&matcher, &matcher_str](int state)
+	{
+		if (matcher_str.empty())
+			return;
+
+		condition match_condition;
+		switch(state)
+		{
+			case 0:
+				match_condition.matching_tag_name = std::move(matcher_str);
+				break;
+			case '#':
+				match_condition.matching_id = std::move(matcher_str);
+				break;
+			case '.':
+				match_condition.matching_class = std::move(matcher_str);
+				break;
+		}
+		matcher_str.clear();
+		matcher.m_conditions.push_back(match_condition);
+	};
+
+	auto push_matcher = [this, &matcher]()
+	{
+		m_matchers.push_back(std::move(matcher));
+		matcher = selector_matcher();
+	};
+
 	CharType c;
 
 	do
@@ -145,23 +218,7 @@ void html::basic_selector<CharType>::build_matchers()
 						break;
 					case METACHAR: case ' ':
 						{
-							if (!matcher_str.empty())
-							{
-								condition match_condition;
-								switch(state)
-								{
-									case 0:
-										match_condition.matching_tag_name = std::move(matcher_str);
-										break;
-									case '#':
-										match_condition.matching_id = std::move(matcher_str);
-										break;
-									case '.':
-										match_condition.matching_class = std::move(matcher_str);
-										break;
-								}
-								matcher.m_conditions.push_back(match_condition);
-							}
+							flush_condition(state);
 							state = c;
 
 							if ( c == ' ')
@@ -169,7 +226,7 @@ void html::basic_selector<CharType>::build_matchers()
 
 							if (state == 0)
 							{
-								m_matchers.push_back(std::move(matcher));
+								push_matcher();
 							}
 						}
 						break;
@@ -177,14 +234,16 @@ void html::basic_selector<CharType>::build_matchers()
 						state = '[';
 						break;
 					case ':':
+						flush_condition(state);
 						state = c;
+						break;
 					default:
 						matcher_str += c;
 				}
 				break;
 			case ' ':
 			{
-				m_matchers.push_back(std::move(matcher));
+				push_matcher();
 				state = 0;
 			}
 			break;
@@ -192,36 +251,52 @@ void html::basic_selector<CharType>::build_matchers()
 			{
 				switch (c)
 				{
-				case METACHAR:
+				case METACHAR: case ' ': case ':':
 					{
-						condition match_condition;
-						int tag_type = 0;
-						std::for_each(matcher_str.begin(), matcher_str.end(), [&match_condition, &tag_type](const CharType Word){
-							if (Word == ':')
-								tag_type = 1;
-							else if (Word == '(' || Word == ')')
-								tag_type = 2;
-							else if (0 == tag_type)
-								match_condition.matching_name += Word;
-							else if (1 == tag_type)
-								match_condition.matching_attr_operator += Word;
-							else if (2 == tag_type)
-								match_condition.matching_index += Word;
-						});
+						// 伪类名与括号里的序号, 例如 eq(2)
+						std::basic_string<CharType> name, index;
+						bool in_parens = false;
+						for (auto Word : matcher_str)
+						{
+							if (Word == '(' || Word == ')')
+								in_parens = Word == '(';
+							else
+								(in_parens ? index : name) += Word;
+						}
+						matcher_str.clear();
 
-						if (match_condition.matching_attr_operator == operator_string_first<CharType>())
+						std::size_t n = 0;
+						bool valid = !index.empty();
+						for (auto digit : index)
 						{
-							match_condition.matching_attr_operator = string_eq<CharType>();
-							match_condition.matching_index = '1';
+							if (digit < '0' || digit > '9')
+								valid = false;
+							else
+								n = n * 10 + (digit - '0');
 						}
-						else if (match_condition.matching_attr_operator == operator_string_last<CharType>())
+
+						if (name == operator_string_first<CharType>())
 						{
-							match_condition.matching_attr_operator = string_eq<CharType>();
+							matcher.m_position = selector_matcher::position_eq;
+							n = 1;
 						}
-						matcher.m_conditions.push_back(match_condition);
-						m_matchers.push_back(std::move(matcher));
-						matcher_str.clear();
-						state = 0;
+						else if (name == operator_string_last<CharType>())
+							matcher.m_position = selector_matcher::position_last;
+						else if (valid && name == string_eq<CharType>())
+							matcher.m_position = selector_matcher::position_eq;
+						else if (valid && name == string_lt<CharType>())
+							matcher.m_position = selector_matcher::position_lt;
+						else if (valid && name == string_gt<CharType>())
+							matcher.m_position = selector_matcher::position_gt;
+						else
+							matcher.m_conditions.push_back(condition());	// 不认识的伪类: 空条件不匹配任何节点
+						matcher.m_position_index = n;
+
+						state = c;
+						if (c == ' ')
+							state = 0;
+						if (state == 0)
+							push_matcher();
 					}
 					break;
 				default:
@@ -265,6 +340,7 @@ void html::basic_selector<CharType>::build_matchers()
 
 template void html::basic_selector<char>::build_matchers();
 template void html::basic_selector<wchar_t>::build_matchers();
+template void html::basic_selector<char16_t>::build_matchers();
 
 template<typename CharType>
 html::basic_dom<CharType>::basic_dom(html::basic_dom<CharType>* parent) noexcept
@@ -274,6 +350,7 @@ html::basic_dom<CharType>::basic_dom(html::basic_dom<CharType>* parent) noexcept
 
 template html::basic_dom<char>::basic_dom(html::basic_dom<char>* parent) noexcept;
 template html::basic_dom<wchar_t>::basic_dom(html::basic_dom<wchar_t>* parent) noexcept;
+template html::basic_dom<char16_t>::basic_dom(html::basic_dom<char16_t>* parent) noexcept;
 
 
 template<typename CharType>
@@ -285,65 +362,89 @@ html::basic_dom<CharType>::basic_dom(const std::basic_string<CharType>& html_pag
 
 template html::basic_dom<char>::basic_dom(const std::basic_string<char>& html_page, html::basic_dom<char>* parent);
 template html::basic_dom<wchar_t>::basic_dom(const std::basic_string<wchar_t>& html_page, html::basic_dom<wchar_t>* parent);
+template html::basic_dom<char16_t>::basic_dom(const std::basic_string<char16_t>& html_page, html::basic_dom<char16_t>* parent);
 
 template<typename CharType>
 html::basic_dom<CharType>::basic_dom(html::basic_dom<CharType>&& d)
-	: attributes(std::move(d.attributes))
+	: html_parser_feeder(std::move(d.html_parser_feeder))
+	, html_parser_feeder_inialized(std::move(d.html_parser_feeder_inialized))
+	, attributes(std::move(d.attributes))
+	, m_raw_attributes(std::move(d.m_raw_attributes))
+	, m_pool(std::move(d.m_pool))
 	, tag_name(std::move(d.tag_name))
 	, content_text(std::move(d.content_text))
-	, m_parent(std::move(d.m_parent))
 	, children(std::move(d.children))
-	, html_parser_feeder(std::move(d.html_parser_feeder))
-	, html_parser_feeder_inialized(std::move(d.html_parser_feeder_inialized))
+	, m_parent(std::move(d.m_parent))
+	, m_order(d.m_order)
+	, m_subtree_end(d.m_subtree_end)
+	, m_lazy(std::move(d.m_lazy))
 {
 }
 
 template html::basic_dom<char>::basic_dom(html::basic_dom<char>&& d);
 template html::basic_dom<wchar_t>::basic_dom(html::basic_dom<wchar_t>&& d);
+template html::basic_dom<char16_t>::basic_dom(html::basic_dom<char16_t>&& d);
 
 template<typename CharType>
 html::basic_dom<CharType>::basic_dom(const html::basic_dom<CharType>& d)
-	: attributes(d.attributes)
+	: html_parser_feeder_inialized(false)
+	, attributes(d.attributes)
+	, m_raw_attributes(d.m_raw_attributes)
+	, m_pool(d.m_pool)
 	, tag_name(d.tag_name)
 	, content_text(d.content_text)
+	, children(d.get_children())
 	, m_parent(d.m_parent)
-	, children(d.children)
-	, html_parser_feeder_inialized(false)
+	, m_order(d.m_order)
+	, m_subtree_end(d.m_subtree_end)
 {
 }
 
 template html::basic_dom<char>::basic_dom(const html::basic_dom<char>& d);
 template html::basic_dom<wchar_t>::basic_dom(const html::basic_dom<wchar_t>& d);
+template html::basic_dom<char16_t>::basic_dom(const html::basic_dom<char16_t>& d);
 
 template<typename CharType>
 html::basic_dom<CharType>& html::basic_dom<CharType>::operator=(const html::basic_dom<CharType>& d)
 {
 	attributes = d.attributes;
+	m_raw_attributes = d.m_raw_attributes;
+	m_pool = d.m_pool;
 	tag_name = d.tag_name;
 	content_text = d.content_text;
 	m_parent = d.m_parent;
-	children = d.children;
+	children = d.get_children();
+	m_order = d.m_order;
+	m_subtree_end = d.m_subtree_end;
+	m_lazy.reset();
 	html_parser_feeder_inialized = false;
 	return *this;
 }
 
 template html::basic_dom<char>& html::basic_dom<char>::operator=(const html::basic_dom<char>& d);
 template html::basic_dom<wchar_t>& html::basic_dom<wchar_t>::operator=(const html::basic_dom<wchar_t>& d);
+template html::basic_dom<char16_t>& html::basic_dom<char16_t>::operator=(const html::basic_dom<char16_t>& d);
 
 template<typename CharType>
 html::basic_dom<CharType>& html::basic_dom<CharType>::operator=(html::basic_dom<CharType>&& d)
 {
 	attributes = std::move(d.attributes);
+	m_raw_attributes = std::move(d.m_raw_attributes);
+	m_pool = std::move(d.m_pool);
 	tag_name = std::move(d.tag_name);
 	content_text = std::move(d.content_text);
 	m_parent = std::move(d.m_parent);
 	children = std::move(d.children);
+	m_order = d.m_order;
+	m_subtree_end = d.m_subtree_end;
+	m_lazy = std::move(d.m_lazy);
 	html_parser_feeder_inialized = false;
 	return *this;
 }
 
 template html::basic_dom<char>& html::basic_dom<char>::operator=(html::basic_dom<char>&& d);
 template html::basic_dom<wchar_t>& html::basic_dom<wchar_t>::operator=(html::basic_dom<wchar_t>&& d);
+template html::basic_dom<char16_t>& html::basic_dom<char16_t>::operator=(html::basic_dom<char16_t>&& d);
 
 template<typename CharType>
 html::detail::basic_dom_node_parser<CharType>::basic_dom_node_parser(html::basic_dom<CharType>* domer, const std::basic_string<CharType>& str)
@@ -354,6 +455,7 @@ html::detail::basic_dom_node_parser<CharType>::basic_dom_node_parser(html::basic
 
 template html::detail::basic_dom_node_parser<char>::basic_dom_node_parser(html::basic_dom<char>* domer, const std::basic_string<char>& str);
 template html::detail::basic_dom_node_parser<wchar_t>::basic_dom_node_parser(html::basic_dom<wchar_t>* domer, const std::basic_string<wchar_t>& str);
+template html::detail::basic_dom_node_parser<char16_t>::basic_dom_node_parser(html::basic_dom<char16_t>* domer, const std::basic_string<char16_t>& str);
 
 template<typename CharType>
 html::detail::basic_dom_node_parser<CharType>::basic_dom_node_parser(const basic_dom_node_parser& other)
@@ -367,6 +469,7 @@ html::detail::basic_dom_node_parser<CharType>::basic_dom_node_parser(const basic
 
 template html::detail::basic_dom_node_parser<char>::basic_dom_node_parser(const basic_dom_node_parser& other);
 template html::detail::basic_dom_node_parser<wchar_t>::basic_dom_node_parser(const basic_dom_node_parser& other);
+template html::detail::basic_dom_node_parser<char16_t>::basic_dom_node_parser(const basic_dom_node_parser& other);
 
 template<typename CharType>
 html::detail::basic_dom_node_parser<CharType>::basic_dom_node_parser(basic_dom_node_parser&& other)
@@ -380,21 +483,27 @@ html::detail::basic_dom_node_parser<CharType>::basic_dom_node_parser(basic_dom_n
 
 template html::detail::basic_dom_node_parser<char>::basic_dom_node_parser(basic_dom_node_parser&& other);
 template html::detail::basic_dom_node_parser<wchar_t>::basic_dom_node_parser(basic_dom_node_parser&& other);
+template html::detail::basic_dom_node_parser<char16_t>::basic_dom_node_parser(basic_dom_node_parser&& other);
 
 template<typename CharType>
 html::detail::basic_dom_node_parser<CharType>::~basic_dom_node_parser()
 {
 	if (m_dom)
+	{
+		m_dom->m_signal_connected = m_sig_connection.connected();
 		m_dom->html_parser_feeder(&m_str);
+		m_dom->m_signal_connected = false;
+	}
 	if (m_sig_connection.connected())
 		m_sig_connection.disconnect();
 }
 
 template html::detail::basic_dom_node_parser<char>::~basic_dom_node_parser();
 template html::detail::basic_dom_node_parser<wchar_t>::~basic_dom_node_parser();
+template html::detail::basic_dom_node_parser<char16_t>::~basic_dom_node_parser();
 
 template<typename CharType>
-void html::detail::basic_dom_node_parser<CharType>::operator()(tag_stage s, std::shared_ptr<basic_dom<CharType>> nodeptr)
+void html::detail::basic_dom_node_parser<CharType>::operator()(tag_stage s, const std::shared_ptr<basic_dom<CharType>>& nodeptr)
 {
 	if (!m_selector)
 	{
@@ -423,11 +532,14 @@ template<typename CharType>
 void html::detail::basic_dom_node_parser<CharType>::set_callback_fuction(std::function<void(tag_stage, std::shared_ptr<html::basic_dom<CharType>>)>&& cb)
 {
 	m_callback = cb;
-	m_sig_connection = m_dom->m_new_node_signal.connect(*this);
+	if (!m_dom->m_new_node_signal)
+		m_dom->m_new_node_signal.reset(new typename decltype(m_dom->m_new_node_signal)::element_type);
+	m_sig_connection = m_dom->m_new_node_signal->connect(*this);
 }
 
 template void html::detail::basic_dom_node_parser<char>::set_callback_fuction(std::function<void(tag_stage, std::shared_ptr<html::basic_dom<char>>)>&& cb);
 template void html::detail::basic_dom_node_parser<wchar_t>::set_callback_fuction(std::function<void(tag_stage, std::shared_ptr<html::basic_dom<wchar_t>>)>&& cb);
+template void html::detail::basic_dom_node_parser<char16_t>::set_callback_fuction(std::function<void(tag_stage, std::shared_ptr<html::basic_dom<char16_t>>)>&& cb);
 
 template<typename CharType>
 html::detail::basic_dom_node_parser<CharType>& html::detail::basic_dom_node_parser<CharType>::operator | (const basic_selector<CharType>& selector_)
@@ -438,14 +550,18 @@ html::detail::basic_dom_node_parser<CharType>& html::detail::basic_dom_node_pars
 
 template html::detail::basic_dom_node_parser<char>& html::detail::basic_dom_node_parser<char>::operator | (const basic_selector<char>& selector_);
 template html::detail::basic_dom_node_parser<wchar_t>& html::detail::basic_dom_node_parser<wchar_t>::operator | (const basic_selector<wchar_t>& selector_);
+template html::detail::basic_dom_node_parser<char16_t>& html::detail::basic_dom_node_parser<char16_t>::operator | (const basic_selector<char16_t>& selector_);
 
 template<typename CharType>
 html::detail::basic_dom_node_parser<CharType> html::basic_dom<CharType>::append_partial_html(const std::basic_string<CharType>& str)
 {
+	if (m_frozen)
+		throw std::logic_error("append_partial_html on a frozen dom");
+
 	if (!html_parser_feeder_inialized)
 	{
 		html_parser_feeder = decltype(html_parser_feeder)(
-			std::bind(&basic_dom<CharType>::html_parser, this, std::placeholders::_1)
+			std::bind(&basic_dom<CharType>::html_parser, this, std::placeholders::_1, nullptr)
 		);
 		html_parser_feeder_inialized = true;
 	}
@@ -455,20 +571,28 @@ html::detail::basic_dom_node_parser<CharType> html::basic_dom<CharType>::append_
 
 template html::detail::basic_dom_node_parser<char> html::basic_dom<char>::append_partial_html(const std::basic_string<char>& str);
 template html::detail::basic_dom_node_parser<wchar_t> html::basic_dom<wchar_t>::append_partial_html(const std::basic_string<wchar_t>& str);
+template html::detail::basic_dom_node_parser<char16_t> html::basic_dom<char16_t>::append_partial_html(const std::basic_string<char16_t>& str);
 
-template<typename CharType> template<class Handler>
-void html::basic_dom<CharType>::dom_walk(std::shared_ptr<html::basic_dom<CharType>> d, Handler handler)
+template<typename CharType>
+void html::basic_dom<CharType>::set_parse_filter(const basic_parse_filter<CharType>& filter)
 {
-	if(handler(d))
-		for (auto & c : d->children)
-		{
-			if (c->tag_name !=  comment_tag_string<CharType>())
-				dom_walk(c, handler);
-		}
+	if (m_frozen || html_parser_feeder_inialized)
+		throw std::logic_error("set_parse_filter after parsing started");
+
+	// 过滤规则随协程保存, 不占用节点的空间
+	html_parser_feeder = decltype(html_parser_feeder)(
+		std::bind(&basic_dom<CharType>::html_parser, this, std::placeholders::_1,
+			std::make_shared<const basic_parse_filter<CharType>>(filter))
+	);
+	html_parser_feeder_inialized = true;
 }
 
+template void html::basic_dom<char>::set_parse_filter(const basic_parse_filter<char>& filter);
+template void html::basic_dom<wchar_t>::set_parse_filter(const basic_parse_filter<wchar_t>& filter);
+template void html::basic_dom<char16_t>::set_parse_filter(const basic_parse_filter<char16_t>& filter);
+
 template<typename CharType>
-bool html::basic_selector<CharType>::condition::operator()(const html::basic_dom<CharType>& d, int& match_index) const
+bool html::basic_selector<CharType>::condition::operator()(const html::basic_dom<CharType>& d) const
 {
 	if (!matching_tag_name.empty())
 	{
@@ -476,59 +600,43 @@ bool html::basic_selector<CharType>::condition::operator()(const html::basic_dom
 	}
 	if (!matching_id.empty())
 	{
-		auto it = d.attributes.find(id_tag_string<CharType>());
-		if ( it != d.attributes.end())
+		auto value = d.find_attribute(id_tag_string<CharType>());
+		if (value)
 		{
-			return it->second == matching_id;
+			return *value == matching_id;
 		}
 	}
 	if (!matching_class.empty())
 	{
-		auto it = d.attributes.find(class_tag_string<CharType>());
-		if ( it != d.attributes.end())
-		{
-			return it->second == matching_class;
-		}
-	}
-
-	if (!matching_name.empty())
-	{
-		if (matching_attr_operator == string_eq<CharType>())
+		auto value = d.find_attribute(class_tag_string<CharType>());
+		if (value)
 		{
-			if (matching_name == d.tag_name)
-			{
-				match_index += 1;
-				const int index = boost::lexical_cast<int>(matching_index);
-				if (match_index == index)
-					return true;
-				else
-					return false;
-			}
+			return *value == matching_class;
 		}
 	}
 
 	if (!matching_attr.empty())
 	{
-		auto it = d.attributes.find(matching_attr);
-		if (it == d.attributes.end()) return false;
+		auto value = d.find_attribute(matching_attr);
+		if (!value) return false;
 
 		if (matching_attr_operator == operator_string_equalityt<CharType>())
-			return strcmp_ignore_case(it->second, matching_attr_value);
+			return strcmp_ignore_case(*value, matching_attr_value);
 		else if (matching_attr_operator == operator_string_contain<CharType>())
 		{
-			if (matching_attr_value == selector_empty_string<CharType>()) return it->second.empty();
+			if (matching_attr_value == selector_empty_string<CharType>()) return value->empty();
 			else
 			{
-				bool find_result = it->second.find(matching_attr_value) != std::basic_string<CharType>::npos;
+				bool find_result = value->find(matching_attr_value) != std::basic_string<CharType>::npos;
 				return find_result;
 			}
 		}
 		else if (matching_attr_operator == operator_string_inequalityt<CharType>())
 		{
-			if (matching_attr_value == selector_empty_string<CharType>()) return !it->second.empty();
+			if (matching_attr_value == selector_empty_string<CharType>()) return !value->empty();
 			else
 			{
-				bool find_result = it->second.find(matching_attr_value) == std::basic_string<CharType>::npos;
+				bool find_result = value->find(matching_attr_value) == std::basic_string<CharType>::npos;
 				return find_result;
 			}
 		}
@@ -546,12 +654,9 @@ bool html::basic_selector<CharType>::selector_matcher::operator()(const html::ba
 	if (this->all_match)
 		return true;
 
-	bool all_match = false;
-	int  match_index = 0;
-
 	for (auto& c : m_conditions)
 	{
-		if(c(d, match_index))
+		if(c(d))
 		{
 			continue;
 		}
@@ -562,260 +667,2336 @@ bool html::basic_selector<CharType>::selector_matcher::operator()(const html::ba
 }
 
 template<typename CharType>
-html::basic_dom<CharType> html::basic_dom<CharType>::operator[](const basic_selector<CharType>& selector_) const
+typename html::basic_selector<CharType>::selector_matcher::key_kind
+html::basic_selector<CharType>::selector_matcher::required_key(const std::basic_string<CharType>*& key) const
 {
-	html::basic_dom<CharType> selectee_dom;
-	html::basic_dom<CharType> matched_dom(*this);
+	const std::basic_string<CharType> *id_key = nullptr, *class_key = nullptr, *tag_key = nullptr;
 
-	for (auto & matcher : selector_)
+	if (!all_match)
 	{
-		selectee_dom = std::move(matched_dom);
-
-		for( auto & c : selectee_dom.children)
+		for (auto & c : m_conditions)
 		{
-			dom_walk(c, [this, &matcher, &matched_dom, selector_](std::shared_ptr<html::basic_dom<CharType>> i)
-			{
-				if (matcher(*i))
-				{
-					matched_dom.children.push_back(i);
-					return false;		// 节点匹配成功，不再遍历子节点,跳转到下一个节点进行遍历
-				}
-				return true;			// 继续往子节点遍历。
-			});
+			if (!c.matching_id.empty() && !id_key)
+				id_key = &c.matching_id;
+			if (!c.matching_class.empty() && !class_key)
+				class_key = &c.matching_class;
+			if (!c.matching_tag_name.empty() && !tag_key)
+				tag_key = &c.matching_tag_name;
 		}
 	}
 
-	return matched_dom;
-}
-
-template html::basic_dom<char> html::basic_dom<char>::operator[](const basic_selector<char>& selector_) const;
-template html::basic_dom<wchar_t> html::basic_dom<wchar_t>::operator[](const basic_selector<wchar_t>& selector_) const;
-
-template<typename CharType>
-static std::basic_string<CharType> basic_literal(const char* literal);
-
-template<>
-std::basic_string<char> basic_literal(const char* literal)
-{
-	return literal;
-};
-
-template<typename CharType>
-static inline std::basic_string<CharType> get_char_set(const std::basic_string<CharType> type, const std::basic_string<CharType> & default_charset)
-{
-	boost::match_results<const CharType*> what;
-
-	// 首先是 text/html; charset=XXX
-	boost::basic_regex<CharType, boost::regex_traits<CharType> > ex(basic_literal<CharType>("charset=([a-zA-Z0-9\\-_]+)"));
-
-	if( boost::regex_search( type.c_str(), what, ex ) )
+	if (id_key)
 	{
-		return what[1];
+		key = id_key;
+		return key_id;
 	}
-	else if( boost::regex_search( default_charset.c_str(), what, ex ) )
+	if (class_key)
 	{
-		return what[1];
+		key = class_key;
+		return key_class;
 	}
-
-	return default_charset;
+	if (tag_key)
+	{
+		key = tag_key;
+		return key_tag;
+	}
+	key = nullptr;
+	return key_none;
 }
 
-namespace html{
-template<>
-std::basic_string<char> basic_dom<char>::basic_charset(const std::string& default_charset) const
+template<typename CharType>
+const std::basic_string<CharType>* html::basic_selector<CharType>::selector_matcher::required_tag_name() const
 {
-	auto charset_dom = (*this)["meta"];
-
-	try {
-		for (auto & c : charset_dom.children)
+	if (!all_match)
+	{
+		for (auto & c : m_conditions)
 		{
-			dom_walk(c, [this, &default_charset](std::shared_ptr<basic_dom<char>> i)
-			{
-				if (strcmp_ignore_case(i->get_attr("http-equiv"), "content-type"))
-				{
-					auto content = i->get_attr("content");
-
-					if (!content.empty())
-					{
-						auto cset = get_char_set(content, default_charset);
-
-						throw cset;
-					}
-				}
-
-				if (!i->get_attr("charset").empty())
-				{
-					throw i->get_attr("charset");
-				}
-
-				return true;
-			});
+			if (!c.matching_tag_name.empty())
+				return &c.matching_tag_name;
 		}
-	}catch(const std::string& cset)
-	{
-		return cset;
 	}
-
-	return default_charset;
-}
+	return nullptr;
 }
 
 template<typename CharType>
-std::basic_string<CharType> html::basic_dom<CharType>::to_plain_text() const
+bool html::basic_selector<CharType>::selector_matcher::keep_position(std::size_t position, bool& done) const
 {
-	std::basic_string<CharType> ret;
+	switch (m_position)
+	{
+		case position_eq:
+			done = position >= m_position_index;
+			return position == m_position_index;
+		case position_lt:
+			done = position + 1 >= m_position_index;
+			return position < m_position_index;
+		case position_gt:
+			done = false;
+			return position > m_position_index;
+		default:
+			done = false;
+			return true;
+	}
+}
 
-	if (!strcmp_ignore_case(tag_name, script_tag_string<CharType>()) && tag_name != comment_tag_string<CharType>())
+namespace html { namespace detail {
+
+	// 按 fold_case 转成小写, 与 strcmp_ignore_case 的比较结果一致
+	template<typename CharType>
+	inline std::basic_string<CharType> fold_case_copy(std::basic_string<CharType> s)
 	{
-		ret += content_text;
+		for (auto & c : s)
+			c = fold_case(c);
+		return s;
+	}
 
-		for ( auto & c : children)
+	template<typename CharType>
+	inline std::size_t hash_key(const std::basic_string<CharType>& s, std::size_t seed, bool ignore_case)
+	{
+		// FNV-1a, tag 名按小写计算
+		std::size_t h = 2166136261u ^ seed;
+		for (auto c : s)
 		{
-			ret += c->to_plain_text();
+			if (ignore_case)
+				c = fold_case(c);
+			h = (h ^ static_cast<std::size_t>(c)) * 16777619u;
 		}
+		return h;
 	}
 
-	return ret;
-}
+	// 计数 Bloom filter, 记录当前遍历路径上所有祖先节点的 tag / id / class.
+	// might_contain 返回 false 时一定没有这样的祖先, 返回 true 时需要再精确检查.
+	template<typename CharType>
+	class ancestor_filter
+	{
+	public:
+		typedef typename basic_selector<CharType>::selector_matcher::key_kind key_kind;
 
-template std::basic_string<char> html::basic_dom<char>::to_plain_text() const;
-template std::basic_string<wchar_t> html::basic_dom<wchar_t>::to_plain_text() const;
+		ancestor_filter()
+			: m_counters(filter_size, 0)
+		{}
 
-template<typename CharType>
-void html::basic_dom<CharType>::to_html(std::basic_ostream<CharType>* out, int deep) const
-{
-	if (!tag_name.empty())
-	{
-		for (auto i = 0; i < deep; i++)
-			*out << ' ';
+		static std::size_t hash(key_kind kind, const std::basic_string<CharType>& key)
+		{
+			return hash_key(key, kind, kind == basic_selector<CharType>::selector_matcher::key_tag);
+		}
 
-		if (tag_name!= comment_tag_string<CharType>())
-			*out << "<" << tag_name;
-		else{
-			*out << tag_name;
+		void push(const basic_dom<CharType>& d)
+		{
+			update(d, 1);
 		}
 
-		if (!attributes.empty())
+		void pop(const basic_dom<CharType>& d)
 		{
-			for (auto a : attributes)
-			{
-				*out << ' ';
-				*out << a.first << "=\"" << a.second << "\"";
-			}
+			update(d, -1);
 		}
-		if (tag_name!=comment_tag_string<CharType>())
-			*out << ">\n";
-		else{
-			*out << content_text;
-			*out << "-->\n";
+
+		bool might_contain(std::size_t h) const
+		{
+			return m_counters[h % filter_size] && m_counters[(h >> 12) % filter_size];
 		}
-	}else
-	{
-		for (auto i = 0; i < deep +1; i++)
-			*out << ' ';
-		*out << content_text << "\n";
-	}
 
-	for ( auto & c : children)
-	{
-		c->to_html(out, deep + 1);
-	}
+	private:
+		static const std::size_t filter_size = 4096;
 
-	if (!tag_name.empty())
-	{
-		if (tag_name!=comment_tag_string<CharType>())
+		void update(const basic_dom<CharType>& d, int delta)
 		{
-			for (auto i = 0; i < deep; i++)
-				*out << ' ';
-			*out << "</" << tag_name << ">\n";
+			typedef typename basic_selector<CharType>::selector_matcher matcher_type;
+
+			add(hash(matcher_type::key_tag, d.tag_name), delta);
+
+			auto value = d.find_attribute(id_tag_string<CharType>());
+			if (value)
+				add(hash(matcher_type::key_id, *value), delta);
+
+			value = d.find_attribute(class_tag_string<CharType>());
+			if (value)
+				add(hash(matcher_type::key_class, *value), delta);
 		}
-	}
-}
 
-template<typename CharType>
-std::basic_string<CharType> html::basic_dom<CharType>::to_html() const
+		void add(std::size_t h, int delta)
+		{
+			m_counters[h % filter_size] += delta;
+			m_counters[(h >> 12) % filter_size] += delta;
+		}
+
+		std::vector<std::uint32_t> m_counters;
+	};
+}}
+
+template<typename CharType> template<class Output>
+bool html::basic_dom<CharType>::select_descendant(const basic_selector<CharType>& selector_, Output& out) const
 {
-	std::basic_stringstream<CharType> ret;
-	to_html(&ret, -1);
-	return ret.str();
-}
+	typedef typename basic_selector<CharType>::selector_matcher matcher_type;
+	typedef detail::ancestor_filter<CharType> filter_type;
 
-template std::basic_string<char> html::basic_dom<char>::to_html() const;
-template std::basic_string<wchar_t> html::basic_dom<wchar_t>::to_html() const;
+	std::vector<const matcher_type*> stages;
+	for (auto & matcher : selector_)
+		stages.push_back(&matcher);
 
-#define CASE_BLANK case ' ': case '\r': case '\n': case '\t'
+	const matcher_type& last = *stages.back();
 
-template<typename CharType>
-void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::pull_type& html_page_source)
-{
-	int pre_state = 0, state = 0;
+	// 除最后一级外, 每一级 matcher 都必须由某个祖先 (或节点自身) 满足,
+	// 预先算出它们必要条件的哈希, 候选节点查一下 filter 即可排除大部分.
+	std::vector<std::size_t> required;
+	for (std::size_t i = 0; i + 1 < stages.size(); i++)
+	{
+		const std::basic_string<CharType>* key;
+		auto kind = stages[i]->required_key(key);
+		if (kind != matcher_type::key_none)
+			required.push_back(filter_type::hash(kind, *key));
+	}
 
-	const std::basic_string<CharType> * _cur_str;
-	typename std::basic_string<CharType>::const_iterator _cur_str_it;
+	filter_type filter;
+	std::vector<const basic_dom<CharType>*> path;
 
-	_cur_str = html_page_source.get();
+	return dom_walk(*this, [&](const basic_dom_ptr& node)
+	{
+		filter.push(*node);
+		path.push_back(node.get());
 
-	_cur_str_it = _cur_str->begin();
+		// 注释节点只有作为 this 的直接子节点时才是候选
+		if (path.size() > 1 && node->tag_name == comment_tag_string<CharType>())
+			return walk_skip_children;
 
-	auto getc = [&_cur_str, &_cur_str_it, &html_page_source](){
+		if (!last(*node))
+			return node->may_contain(last) ? walk_continue : walk_skip_children;
 
-		if (_cur_str_it!= _cur_str->end())
+		for (auto h : required)
 		{
-			return *_cur_str_it++;
+			if (!filter.might_contain(h))
+				return walk_continue;
 		}
 
-		html_page_source();
-		_cur_str = html_page_source.get();
-		_cur_str_it = _cur_str->begin();
-
-		return *_cur_str_it++;
-	};
+		// 从上往下重放 operator[] 的逐级匹配: 每一级的匹配节点本身也是下一级的候选.
+		// 祖先不可能已经走完所有级, 否则它已经是结果, 子树不会被遍历到.
+		std::size_t stage = 0;
+		for (auto n : path)
+		{
+			while (stage < stages.size() && (*stages[stage])(*n))
+				stage++;
+		}
 
-	auto get_escape = [&getc]() -> CharType
+		if (stage == stages.size())
+			return out(node) ? walk_skip_children : walk_stop;
+		return node->may_contain(last) ? walk_continue : walk_skip_children;
+	}, [&filter, &path](const basic_dom<CharType>& node)
 	{
-		return getc();
-	};
+		filter.pop(node);
+		path.pop_back();
+	});
+}
+
+namespace html { namespace detail {
 
-	auto get_string = [&getc, &get_escape, &pre_state, &state](CharType quote_char)
+	// 按 matcher 的位置伪类筛选一级的匹配结果再交给 out. 结果已经确定时返回 false, 让遍历停止
+	template<typename CharType, class Matcher, class Output>
+	class position_filter
 	{
-		std::basic_string<CharType> ret;
+	public:
+		typedef Matcher matcher_type;
 
-		auto c = getc();
+		position_filter(const matcher_type& matcher, Output& out)
+			: m_matcher(matcher)
+			, m_out(out)
+		{}
 
-		while ( (c != quote_char) && (c!= '\n'))
+		bool operator()(const std::shared_ptr<basic_dom<CharType>>& node)
 		{
-			if ( c == '\'' )
-			{
-				c += get_escape();
-			}else
+			if (m_matcher.position() == matcher_type::position_last)
 			{
-				ret += c;
+				m_last = node;
+				return true;
 			}
-			c = getc();
+
+			bool done;
+			if (m_matcher.keep_position(++m_count, done) && !m_out(node))
+				return false;
+			return !done;
 		}
 
-		if (c == '\n')
+		// 遍历结束, 交出 :last 的结果
+		void finish()
 		{
-			pre_state = state;
-			state = 0;
-
+			if (m_last)
+				m_out(m_last);
 		}
-		return ret;
-	};
-
-	std::basic_string<CharType> tag; //当前处理的 tag
-	std::basic_string<CharType> content; // 当前 tag 下的内容
-	std::basic_string<CharType> k,v;
 
-	auto current_ptr = this;
+	private:
+		const matcher_type& m_matcher;
+		Output& m_out;
+		std::size_t m_count = 0;
+		std::shared_ptr<basic_dom<CharType>> m_last;
+	};
+}}
 
-	CharType c;
+template<typename CharType> template<class Output>
+bool html::basic_dom<CharType>::select_stage(const std::vector<basic_dom_ptr>& starts, const typename basic_selector<CharType>::selector_matcher& matcher, Output& out)
+{
+	detail::position_filter<CharType, typename basic_selector<CharType>::selector_matcher, Output> positioned(matcher, out);
 
-	std::vector<int> comment_stack;
+	auto visit = [&matcher, &positioned](const basic_dom_ptr& i)
+	{
+		if (i->tag_name == comment_tag_string<CharType>())
+			return walk_skip_children;
 
-	bool ignore_blank = false;
+		if (matcher(*i))
+		{
+			// 节点匹配成功，不再遍历子节点,跳转到下一个节点进行遍历
+			return positioned(i) ? walk_skip_children : walk_stop;
+		}
+		// 继续往子节点遍历, 除非它是不可能有匹配的未展开子树
+		return i->may_contain(matcher) ? walk_continue : walk_skip_children;
+	};
 
-	while(html_page_source) // EOF 检测
+	// 起点本身也参与匹配, 即使是注释节点
+	for (auto & c : starts)
+	{
+		if (matcher(*c))
+		{
+			if (!positioned(c))
+				return false;
+		}
+		else if (c->may_contain(matcher) && !dom_walk(*c, visit))
+			return false;
+	}
+
+	positioned.finish();
+	return true;
+}
+
+template<typename CharType> template<class Output>
+void html::basic_dom<CharType>::select_into(const basic_selector<CharType>& selector_, Output&& out) const
+{
+	typedef typename basic_selector<CharType>::selector_matcher matcher_type;
+
+	auto stage_count = std::distance(selector_.begin(), selector_.end());
+
+	if (stage_count == 0)
+	{
+		for (auto & c : get_children())
+		{
+			if (!out(c))
+				return;
+		}
+		return;
+	}
+
+	const matcher_type& last = *(selector_.end() - 1);
+
+	bool positioned = false;
+	for (auto it = selector_.begin(); it + 1 < selector_.end(); ++it)
+		positioned = positioned || it->has_position();
+
+	if (stage_count > 1 && !positioned)
+	{
+		if (last.has_position())
+		{
+			detail::position_filter<CharType, matcher_type, Output> filter(last, out);
+			if (select_descendant(selector_, filter))
+				filter.finish();
+		}
+		else
+			select_descendant(selector_, out);
+		return;
+	}
+
+	// 中间某一级要按位置筛选时, 它的全部结果确定之后才能匹配下一级, 只能逐级进行
+	const std::vector<basic_dom_ptr>* starts = &get_children();
+	std::vector<basic_dom_ptr> matched, next;
+	for (auto it = selector_.begin(); it + 1 < selector_.end(); ++it)
+	{
+		next.clear();
+		auto collect = [&next](const basic_dom_ptr& i)
+		{
+			next.push_back(i);
+			return true;
+		};
+		select_stage(*starts, *it, collect);
+		matched.swap(next);
+		starts = &matched;
+	}
+
+	select_stage(*starts, last, out);
+}
+
+template<typename CharType>
+html::basic_dom<CharType> html::basic_dom<CharType>::operator[](const basic_selector<CharType>& selector_) const
+{
+	if (selector_.begin() == selector_.end())
+		return html::basic_dom<CharType>(*this);
+
+	html::basic_dom<CharType> matched_dom;
+
+	select_into(selector_, [&matched_dom](const basic_dom_ptr& i)
+	{
+		matched_dom.children.push_back(i);
+		return true;
+	});
+
+	// 在并集这样互相包含的结果上再查询时, 同一个节点会从多个起点被找到
+	if (!children_disjoint())
+		unique_in_document_order(matched_dom.children);
+
+	return matched_dom;
+}
+
+template html::basic_dom<char> html::basic_dom<char>::operator[](const basic_selector<char>& selector_) const;
+template html::basic_dom<wchar_t> html::basic_dom<wchar_t>::operator[](const basic_selector<wchar_t>& selector_) const;
+template html::basic_dom<char16_t> html::basic_dom<char16_t>::operator[](const basic_selector<char16_t>& selector_) const;
+
+template<typename CharType>
+std::vector<const html::basic_dom<CharType>*> html::basic_dom<CharType>::select(const basic_selector<CharType>& selector_) const
+{
+	std::vector<const basic_dom<CharType>*> result;
+
+	select_into(selector_, [&result](const basic_dom_ptr& i)
+	{
+		result.push_back(i.get());
+		return true;
+	});
+
+	if (!children_disjoint())
+		unique_in_document_order(result);
+
+	return result;
+}
+
+template std::vector<const html::basic_dom<char>*> html::basic_dom<char>::select(const basic_selector<char>& selector_) const;
+template std::vector<const html::basic_dom<wchar_t>*> html::basic_dom<wchar_t>::select(const basic_selector<wchar_t>& selector_) const;
+template std::vector<const html::basic_dom<char16_t>*> html::basic_dom<char16_t>::select(const basic_selector<char16_t>& selector_) const;
+
+template<typename CharType>
+html::basic_dom<CharType> html::basic_dom<CharType>::query(const basic_selector<CharType>& selector_, std::size_t limit) const
+{
+	html::basic_dom<CharType> matched_dom;
+
+	if (limit == 0)
+		return matched_dom;
+
+	// 互相包含的起点给出的结果不按文档顺序, 要全部找出才知道哪些在最前面
+	if (!children_disjoint())
+	{
+		matched_dom = (*this)[selector_];
+		if (matched_dom.children.size() > limit)
+			matched_dom.children.resize(limit);
+		return matched_dom;
+	}
+
+	select_into(selector_, [&matched_dom, limit](const basic_dom_ptr& i)
+	{
+		matched_dom.children.push_back(i);
+		return matched_dom.children.size() < limit;
+	});
+
+	return matched_dom;
+}
+
+template html::basic_dom<char> html::basic_dom<char>::query(const basic_selector<char>& selector_, std::size_t limit) const;
+template html::basic_dom<wchar_t> html::basic_dom<wchar_t>::query(const basic_selector<wchar_t>& selector_, std::size_t limit) const;
+template html::basic_dom<char16_t> html::basic_dom<char16_t>::query(const basic_selector<char16_t>& selector_, std::size_t limit) const;
+
+template<typename CharType>
+std::shared_ptr<html::basic_dom<CharType>> html::basic_dom<CharType>::query_first(const basic_selector<CharType>& selector_) const
+{
+	auto matched_dom = query(selector_, 1);
+
+	if (matched_dom.children.empty())
+		return nullptr;
+	return matched_dom.children.front();
+}
+
+template std::shared_ptr<html::basic_dom<char>> html::basic_dom<char>::query_first(const basic_selector<char>& selector_) const;
+template std::shared_ptr<html::basic_dom<wchar_t>> html::basic_dom<wchar_t>::query_first(const basic_selector<wchar_t>& selector_) const;
+template std::shared_ptr<html::basic_dom<char16_t>> html::basic_dom<char16_t>::query_first(const basic_selector<char16_t>& selector_) const;
+
+template<typename CharType>
+bool html::basic_dom<CharType>::children_disjoint() const
+{
+	for (std::size_t i = 1; i < children.size(); i++)
+	{
+		if (children[i]->m_order <= children[i - 1]->m_subtree_end)
+			return false;
+	}
+	return true;
+}
+
+template bool html::basic_dom<char>::children_disjoint() const;
+template bool html::basic_dom<wchar_t>::children_disjoint() const;
+template bool html::basic_dom<char16_t>::children_disjoint() const;
+
+template<typename CharType>
+html::basic_dom<CharType> html::basic_dom<CharType>::operator|(const basic_dom<CharType>& other) const
+{
+	auto a = get_children(), b = other.get_children();
+	unique_in_document_order(a);
+	unique_in_document_order(b);
+
+	html::basic_dom<CharType> merged;
+	merged.children.reserve(a.size() + b.size());
+	std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(merged.children), document_order_less());
+	return merged;
+}
+
+template html::basic_dom<char> html::basic_dom<char>::operator|(const basic_dom<char>&) const;
+template html::basic_dom<wchar_t> html::basic_dom<wchar_t>::operator|(const basic_dom<wchar_t>&) const;
+template html::basic_dom<char16_t> html::basic_dom<char16_t>::operator|(const basic_dom<char16_t>&) const;
+
+template<typename CharType>
+html::basic_dom<CharType> html::basic_dom<CharType>::operator&(const basic_dom<CharType>& other) const
+{
+	auto a = get_children(), b = other.get_children();
+	unique_in_document_order(a);
+	unique_in_document_order(b);
+
+	html::basic_dom<CharType> common;
+	std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(common.children), document_order_less());
+	return common;
+}
+
+template html::basic_dom<char> html::basic_dom<char>::operator&(const basic_dom<char>&) const;
+template html::basic_dom<wchar_t> html::basic_dom<wchar_t>::operator&(const basic_dom<wchar_t>&) const;
+template html::basic_dom<char16_t> html::basic_dom<char16_t>::operator&(const basic_dom<char16_t>&) const;
+
+template<typename CharType>
+void html::basic_dom<CharType>::freeze()
+{
+	if (m_frozen)
+		return;
+
+	// 结束解析协程, 之后不会再有任何写入
+	html_parser_feeder = decltype(html_parser_feeder)();
+	html_parser_feeder_inialized = false;
+	m_frozen = true;
+
+	// 不展开惰性子树, 只标记它们展开时要像这里一样处理
+	std::vector<basic_dom<CharType>*> stack(1, this);
+	while (!stack.empty())
+	{
+		auto d = stack.back();
+		stack.pop_back();
+
+		d->decoded_attributes();
+		d->children.shrink_to_fit();
+		d->tag_name.shrink_to_fit();
+		d->content_text.shrink_to_fit();
+		if (d->m_lazy)
+			d->m_lazy->frozen = true;
+
+		for (auto & c : d->children)
+			stack.push_back(c.get());
+	}
+}
+
+template void html::basic_dom<char>::freeze();
+template void html::basic_dom<wchar_t>::freeze();
+template void html::basic_dom<char16_t>::freeze();
+
+namespace html { namespace detail {
+
+	// 字符串在堆上的内存, 短字符串存放在对象内部时为 0
+	template<typename CharType>
+	std::size_t string_heap_bytes(const std::basic_string<CharType>& s)
+	{
+		std::less<const char*> less;
+		auto data = reinterpret_cast<const char*>(s.data());
+		auto self = reinterpret_cast<const char*>(&s);
+
+		if (!less(data, self) && less(data, self + sizeof(s)))
+			return 0;
+		return (s.capacity() + 1) * sizeof(CharType);
+	}
+
+	// std::map 的一个树节点: 元素加上三个指针和颜色
+	template<typename Map>
+	std::size_t tree_node_bytes()
+	{
+		return sizeof(typename Map::value_type) + 4 * sizeof(void*);
+	}
+
+	// make_shared 的控制块与对象一起分配, 额外是虚表指针和两个计数
+	const std::size_t shared_block_bytes = 2 * sizeof(void*);
+
+	// 文档级的属性名池, 节点里的属性表以指向池里的指针为键, 每种属性名只存一份.
+	// 属性值直接存放在属性表里: 值的种类多, 逐个计算散列去重的代价超过省下的内存.
+	// 池里的字符串地址在池销毁前不变. 惰性子树可能在多个线程里同时展开, 写入要持有 mutex()
+	template<typename CharType>
+	class string_pool
+	{
+	public:
+		typedef std::basic_string<CharType> string_type;
+
+		std::mutex& mutex() { return m_mutex; }
+
+		const string_type* intern(const string_type& s)
+		{
+			return &*m_strings.insert(s).first;
+		}
+
+		// 一个文档里的属性名种类很少, 先在最近用过的几个里按内容找, 找不到才计算散列
+		const string_type* name(const string_type& k)
+		{
+			for (auto n : m_recent_names)
+				if (n && *n == k)
+					return n;
+
+			auto n = intern(k);
+			m_recent_names[m_next_recent++ % recent_names] = n;
+			return n;
+		}
+
+		// 没有值的属性, 已有同名属性时保留原值
+		template<typename Map>
+		void put(Map& attributes, const string_type& k)
+		{
+			attributes.insert(std::make_pair(name(k), string_type()));
+		}
+
+		template<typename Map>
+		void put(Map& attributes, const string_type& k, const string_type& v)
+		{
+			// 按长度复制, 不带上调用方缓冲区的余量
+			attributes[name(k)].assign(v);
+		}
+
+		// 散列表节点: 字符串, next 指针和缓存的散列值
+		std::size_t memory_usage()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::size_t bytes = sizeof(*this) + m_strings.bucket_count() * sizeof(void*);
+			for (auto & s : m_strings)
+				bytes += sizeof(string_type) + 2 * sizeof(void*) + string_heap_bytes(s);
+			return bytes;
+		}
+
+		void shrink()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_strings.rehash(0);
+		}
+
+	private:
+		std::mutex m_mutex;
+		std::unordered_set<string_type> m_strings;
+		static const std::size_t recent_names = 8;
+		const string_type* m_recent_names[recent_names] = {};
+		std::size_t m_next_recent = 0;
+		std::atomic<std::size_t> m_refs{0};
+
+		friend void intrusive_ptr_add_ref<>(string_pool*);
+		friend void intrusive_ptr_release<>(string_pool*);
+	};
+
+	template<typename CharType>
+	void intrusive_ptr_add_ref(string_pool<CharType>* p)
+	{
+		p->m_refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	template<typename CharType>
+	void intrusive_ptr_release(string_pool<CharType>* p)
+	{
+		if (p->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete p;
+	}
+
+	template void intrusive_ptr_add_ref(string_pool<char>*);
+	template void intrusive_ptr_add_ref(string_pool<wchar_t>*);
+	template void intrusive_ptr_add_ref(string_pool<char16_t>*);
+	template void intrusive_ptr_release(string_pool<char>*);
+	template void intrusive_ptr_release(string_pool<wchar_t>*);
+	template void intrusive_ptr_release(string_pool<char16_t>*);
+}}
+
+template<typename CharType>
+html::dom_memory_usage html::basic_dom<CharType>::memory_usage() const
+{
+	dom_memory_usage usage;
+	// 同一次 append_html_lazy 的子树共用一份页面, 字符串池通常整个文档共用一个, 都只计一次
+	std::set<const void*> pages, pools;
+
+	if (html_parser_feeder_inialized && html_parser_feeder)
+		usage.parser = boost::coroutines::stack_traits::default_size();
+
+	std::vector<const basic_dom<CharType>*> stack(1, this);
+	while (!stack.empty())
+	{
+		auto d = stack.back();
+		stack.pop_back();
+
+		if (d != this)
+			usage.nodes += sizeof(basic_dom<CharType>) + detail::shared_block_bytes;
+
+		usage.strings += detail::string_heap_bytes(d->tag_name) + detail::string_heap_bytes(d->content_text);
+
+		usage.attributes += detail::string_heap_bytes(d->m_raw_attributes);
+		usage.attributes += d->attributes.size() * detail::tree_node_bytes<attribute_map>();
+		for (auto & a : d->attributes)
+			usage.attributes += detail::string_heap_bytes(a.second);
+		if (d->m_pool && pools.insert(d->m_pool.get()).second)
+			usage.attributes += d->m_pool->memory_usage();
+
+		usage.children += d->children.capacity() * sizeof(basic_dom_ptr);
+
+		if (d->m_lazy)
+		{
+			usage.lazy += sizeof(detail::lazy_subtree<CharType>) + detail::shared_block_bytes;
+			auto & page = d->m_lazy->page;
+			if (page && pages.insert(page.get()).second)
+				usage.lazy += sizeof(*page) + detail::shared_block_bytes + detail::string_heap_bytes(*page);
+		}
+
+		for (auto & c : d->children)
+			stack.push_back(c.get());
+	}
+
+	return usage;
+}
+
+template html::dom_memory_usage html::basic_dom<char>::memory_usage() const;
+template html::dom_memory_usage html::basic_dom<wchar_t>::memory_usage() const;
+template html::dom_memory_usage html::basic_dom<char16_t>::memory_usage() const;
+
+template<typename CharType>
+void html::basic_dom<CharType>::compact()
+{
+	freeze();
+
+	// 属性名和属性值写入时都按长度复制, 只剩池里散列表的桶需要收紧
+	std::set<detail::string_pool<CharType>*> pools;
+	std::vector<basic_dom<CharType>*> stack(1, this);
+	while (!stack.empty())
+	{
+		auto d = stack.back();
+		stack.pop_back();
+
+		if (d->m_pool && pools.insert(d->m_pool.get()).second)
+			d->m_pool->shrink();
+
+		for (auto & c : d->children)
+			stack.push_back(c.get());
+	}
+}
+
+template void html::basic_dom<char>::compact();
+template void html::basic_dom<wchar_t>::compact();
+template void html::basic_dom<char16_t>::compact();
+
+template<typename CharType>
+html::basic_dom<CharType> html::basic_dom<CharType>::select_parallel(const basic_selector<CharType>& selector_, std::size_t serial_threshold, unsigned threads) const
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	// 节点数达到阈值即可停止计数
+	std::size_t node_count = 0;
+	dom_walk(*this, [&node_count, serial_threshold](const basic_dom_ptr&)
+	{
+		return ++node_count < serial_threshold ? walk_continue : walk_stop;
+	});
+
+	// 位置伪类要数遍整级的结果, 而且串行时可以提前结束, 不值得并行
+	bool positioned = false;
+	for (auto & matcher : selector_)
+		positioned = positioned || matcher.has_position();
+
+	if (threads == 1 || node_count < serial_threshold || positioned)
+		return (*this)[selector_];
+
+	html::basic_dom<CharType> selectee_dom;
+	html::basic_dom<CharType> matched_dom(*this);
+
+	for (auto & matcher : selector_)
+	{
+		selectee_dom = std::move(matched_dom);
+
+		// 工作单元: 要么是已经确定匹配的节点, 要么是一棵待遍历的子树.
+		// 单元按文档顺序排列, 合并结果时依次拼接即可保证顺序.
+		struct work_unit
+		{
+			basic_dom_ptr node;
+			bool matched;
+			std::vector<basic_dom_ptr> result;
+		};
+
+		std::vector<work_unit> units;
+		for (auto & c : selectee_dom.children)
+		{
+			// 起点即使是注释节点也参与匹配, 之后 worker 会跳过注释单元
+			if (c->tag_name == comment_tag_string<CharType>())
+			{
+				if (matcher(*c))
+					units.push_back(work_unit{c, true, {}});
+				continue;
+			}
+			units.push_back(work_unit{c, false, {}});
+		}
+
+		// 顶层子树太少时(例如只有一个 <html>), 逐层展开直到单元数足够多
+		const std::size_t wanted_units = threads * 8;
+		while (units.size() < wanted_units)
+		{
+			std::vector<work_unit> expanded;
+			bool changed = false;
+
+			for (auto & u : units)
+			{
+				if (u.matched || u.node->get_children().empty() || u.node->tag_name == comment_tag_string<CharType>())
+				{
+					expanded.push_back(std::move(u));
+					continue;
+				}
+
+				changed = true;
+				if (matcher(*u.node))
+				{
+					u.matched = true;
+					expanded.push_back(std::move(u));
+					continue;
+				}
+
+				for (auto & c : u.node->get_children())
+					expanded.push_back(work_unit{c, false, {}});
+			}
+
+			units = std::move(expanded);
+			if (!changed)
+				break;
+		}
+
+		// 工作线程从共享游标上领取单元, 先做完的线程自然会多领, 达到负载均衡
+		std::atomic<std::size_t> next_unit(0);
+		// 每个线程的异常各自保存, 所有线程都 join 之后再抛出第一个
+		std::vector<std::exception_ptr> errors(threads);
+		auto worker = [&units, &next_unit, &matcher, &errors](unsigned slot)
+		{
+			try
+			{
+				for (std::size_t i = next_unit++; i < units.size(); i = next_unit++)
+				{
+					work_unit& u = units[i];
+					if (u.matched)
+						continue;
+
+					if (u.node->tag_name == comment_tag_string<CharType>())
+						continue;
+
+					if (matcher(*u.node))
+					{
+						u.matched = true;
+						continue;
+					}
+
+					dom_walk(*u.node, [&matcher, &u](const basic_dom_ptr& n)
+					{
+						if (n->tag_name == comment_tag_string<CharType>())
+							return walk_skip_children;
+
+						if (matcher(*n))
+						{
+							u.result.push_back(n);
+							return walk_skip_children;
+						}
+						return walk_continue;
+					});
+				}
+			}
+			catch (...)
+			{
+				errors[slot] = std::current_exception();
+				// 让其它线程领不到新的单元, 尽快结束
+				next_unit = units.size();
+			}
+		};
+
+		std::vector<std::thread> pool;
+		try
+		{
+			for (unsigned t = 1; t < threads; t++)
+				pool.emplace_back(worker, t);
+		}
+		catch (const std::system_error&)
+		{
+			// 创建不了更多线程时, 由已有的线程 (至少有当前线程) 做完所有单元
+		}
+		worker(0);
+		for (auto & t : pool)
+			t.join();
+
+		for (auto & e : errors)
+		{
+			if (e)
+				std::rethrow_exception(e);
+		}
+
+		for (auto & u : units)
+		{
+			if (u.matched)
+				matched_dom.children.push_back(std::move(u.node));
+			else
+				matched_dom.children.insert(matched_dom.children.end(),
+					std::make_move_iterator(u.result.begin()), std::make_move_iterator(u.result.end()));
+		}
+	}
+
+	return matched_dom;
+}
+
+template html::basic_dom<char> html::basic_dom<char>::select_parallel(const basic_selector<char>& selector_, std::size_t, unsigned) const;
+template html::basic_dom<wchar_t> html::basic_dom<wchar_t>::select_parallel(const basic_selector<wchar_t>& selector_, std::size_t, unsigned) const;
+template html::basic_dom<char16_t> html::basic_dom<char16_t>::select_parallel(const basic_selector<char16_t>& selector_, std::size_t, unsigned) const;
+
+template<typename CharType>
+std::vector<html::basic_dom<CharType>> html::basic_dom<CharType>::select_batch(const std::vector<basic_selector<CharType>>& selectors) const
+{
+	typedef std::basic_string<CharType> string_type;
+	typedef typename basic_selector<CharType>::selector_matcher matcher_type;
+
+	// (selector 序号, matcher 级数)
+	typedef std::pair<std::size_t, std::size_t> dispatch_entry;
+
+	std::vector<std::vector<const matcher_type*>> stages(selectors.size());
+	std::vector<html::basic_dom<CharType>> results(selectors.size());
+
+	// 每个 matcher 按其 required_key 登记, 没有必要条件的登记为通配.
+	std::unordered_map<string_type, std::vector<dispatch_entry>> id_table, class_table, tag_table;
+	std::vector<dispatch_entry> universal;
+
+	for (std::size_t i = 0; i < selectors.size(); i++)
+	{
+		// 带位置伪类的 selector 要数遍整级的结果, 单独求值, 不参与分派
+		bool positioned = false;
+		for (auto & matcher : selectors[i])
+			positioned = positioned || matcher.has_position();
+		if (positioned)
+		{
+			results[i] = (*this)[selectors[i]];
+			continue;
+		}
+
+		for (auto & matcher : selectors[i])
+			stages[i].push_back(&matcher);
+
+		if (stages[i].empty())
+			results[i] = *this;
+
+		for (std::size_t stage = 0; stage < stages[i].size(); stage++)
+		{
+			const string_type* key;
+
+			switch (stages[i][stage]->required_key(key))
+			{
+				case matcher_type::key_id:
+					id_table[*key].emplace_back(i, stage);
+					break;
+				case matcher_type::key_class:
+					class_table[*key].emplace_back(i, stage);
+					break;
+				case matcher_type::key_tag:
+					tag_table[detail::fold_case_copy(*key)].emplace_back(i, stage);
+					break;
+				default:
+					universal.emplace_back(i, stage);
+			}
+		}
+	}
+
+	// 每层祖先对应一帧, 记录各 selector 在该路径上已匹配到第几级.
+	// 等于级数时表示该 selector 在这棵子树里已经有了结果.
+	const std::size_t width = selectors.size();
+	std::vector<std::size_t> state_stack(width, 0);
+	std::size_t depth = 0;
+
+	auto lookup = [](const std::unordered_map<string_type, std::vector<dispatch_entry>>& table, const string_type& key)
+		-> const std::vector<dispatch_entry>*
+	{
+		auto it = table.find(key);
+		return it == table.end() ? nullptr : &it->second;
+	};
+
+	dom_walk(*this, [&](const basic_dom_ptr& node)
+	{
+		state_stack.resize((depth + 2) * width);
+		std::size_t* cur = &state_stack[depth * width];
+		std::size_t* next = cur + width;
+		std::copy(cur, cur + width, next);
+		depth++;
+
+		// 注释节点只有作为 this 的直接子节点时才是候选
+		if (depth > 1 && node->tag_name == comment_tag_string<CharType>())
+			return walk_skip_children;
+
+		const std::vector<dispatch_entry>* candidates[4] = {
+			&universal,
+			tag_table.empty() ? nullptr : lookup(tag_table, detail::fold_case_copy(node->tag_name)),
+			nullptr,
+			nullptr,
+		};
+
+		if (!id_table.empty())
+		{
+			auto value = node->find_attribute(id_tag_string<CharType>());
+			if (value)
+				candidates[2] = lookup(id_table, *value);
+		}
+		if (!class_table.empty())
+		{
+			auto value = node->find_attribute(class_tag_string<CharType>());
+			if (value)
+				candidates[3] = lookup(class_table, *value);
+		}
+
+		for (auto list : candidates)
+		{
+			if (!list)
+				continue;
+
+			for (auto & entry : *list)
+			{
+				const std::size_t i = entry.first;
+				if (cur[i] != entry.second || !(*stages[i][entry.second])(*node))
+					continue;
+
+				// 节点本身也是下一级 matcher 的候选, 与 operator[] 一致
+				std::size_t stage = entry.second + 1;
+				while (stage < stages[i].size() && (*stages[i][stage])(*node))
+					stage++;
+
+				next[i] = stage;
+				if (stage == stages[i].size())
+					results[i].children.push_back(node);
+			}
+		}
+
+		for (std::size_t i = 0; i < width; i++)
+			if (next[i] < stages[i].size())
+				return walk_continue;
+
+		return walk_skip_children;
+	}, [&depth](const basic_dom<CharType>&)
+	{
+		depth--;
+	});
+
+	return results;
+}
+
+template std::vector<html::basic_dom<char>> html::basic_dom<char>::select_batch(const std::vector<basic_selector<char>>&) const;
+template std::vector<html::basic_dom<wchar_t>> html::basic_dom<wchar_t>::select_batch(const std::vector<basic_selector<wchar_t>>&) const;
+template std::vector<html::basic_dom<char16_t>> html::basic_dom<char16_t>::select_batch(const std::vector<basic_selector<char16_t>>&) const;
+
+// ASCII 字面量转换成 CharType 字符串, 不经过 locale (char16_t 没有 ctype facet)
+template<typename CharType>
+static std::basic_string<CharType> basic_literal(const char* literal)
+{
+	return std::basic_string<CharType>(literal, literal + std::char_traits<char>::length(literal));
+}
+
+template<typename CharType>
+static inline std::basic_string<CharType> get_char_set(const std::basic_string<CharType> type, const std::basic_string<CharType> & default_charset)
+{
+	boost::match_results<const CharType*> what;
+
+	// 首先是 text/html; charset=XXX
+	boost::basic_regex<CharType, boost::regex_traits<CharType> > ex(basic_literal<CharType>("charset=([a-zA-Z0-9\\-_]+)"));
+
+	if( boost::regex_search( type.c_str(), what, ex ) )
+	{
+		return what[1];
+	}
+	else if( boost::regex_search( default_charset.c_str(), what, ex ) )
+	{
+		return what[1];
+	}
+
+	return default_charset;
+}
+
+namespace html{
+template<>
+std::basic_string<char> basic_dom<char>::basic_charset(const std::string& default_charset) const
+{
+	std::basic_string<char> cset;
+
+	// 依次检查每个 <meta> 及其子树 (没有关闭的 <meta> 会包含后面的节点), 找到即停止整个查询
+	auto check = [&default_charset, &cset](const basic_dom_ptr& i)
+	{
+		if (strcmp_ignore_case(i->get_attr("http-equiv"), "content-type"))
+		{
+			auto content = i->get_attr("content");
+
+			if (!content.empty())
+			{
+				cset = get_char_set(content, default_charset);
+				return walk_stop;
+			}
+		}
+
+		if (!i->get_attr("charset").empty())
+		{
+			cset = i->get_attr("charset");
+			return walk_stop;
+		}
+
+		return walk_continue;
+	};
+
+	select_into(basic_selector<char>("meta"), [&check](const basic_dom_ptr& meta)
+	{
+		return check(meta) != walk_stop && dom_walk(*meta, check);
+	});
+
+	if (!cset.empty())
+		return cset;
+
+	return default_charset;
+}
+}
+
+template<typename CharType>
+std::basic_string<CharType> html::basic_dom<CharType>::to_plain_text() const
+{
+	std::basic_string<CharType> ret;
+
+	if (!strcmp_ignore_case(tag_name, script_tag_string<CharType>()) && tag_name != comment_tag_string<CharType>())
+	{
+		ret += content_text;
+
+		dom_walk(*this, [&ret](const basic_dom_ptr& c)
+		{
+			if (strcmp_ignore_case(c->tag_name, script_tag_string<CharType>()) || c->tag_name == comment_tag_string<CharType>())
+				return walk_skip_children;
+
+			ret += c->content_text;
+			return walk_continue;
+		});
+	}
+
+	return ret;
+}
+
+template std::basic_string<char> html::basic_dom<char>::to_plain_text() const;
+template std::basic_string<wchar_t> html::basic_dom<wchar_t>::to_plain_text() const;
+template std::basic_string<char16_t> html::basic_dom<char16_t>::to_plain_text() const;
+
+template<typename CharType, class AttributeMap>
+static void to_html_open(std::basic_ostream<CharType>* out, const std::basic_string<CharType>& tag_name,
+	const AttributeMap& attributes, const std::basic_string<CharType>& content_text, int deep)
+{
+	if (!tag_name.empty())
+	{
+		for (auto i = 0; i < deep; i++)
+			*out << CharType(' ');
+
+		if (tag_name!= comment_tag_string<CharType>())
+			*out << CharType('<') << tag_name;
+		else{
+			*out << tag_name;
+		}
+
+		if (!attributes.empty())
+		{
+			for (auto & a : attributes)
+			{
+				*out << CharType(' ');
+				*out << *a.first << basic_literal<CharType>("=\"") << a.second << CharType('"');
+			}
+		}
+		if (tag_name!=comment_tag_string<CharType>())
+			*out << basic_literal<CharType>(">\n");
+		else{
+			*out << content_text;
+			*out << basic_literal<CharType>("-->\n");
+		}
+	}else
+	{
+		for (auto i = 0; i < deep +1; i++)
+			*out << CharType(' ');
+		*out << content_text << CharType('\n');
+	}
+}
+
+template<typename CharType>
+static void to_html_close(std::basic_ostream<CharType>* out, const std::basic_string<CharType>& tag_name, int deep)
+{
+	if (!tag_name.empty())
+	{
+		if (tag_name!=comment_tag_string<CharType>())
+		{
+			for (auto i = 0; i < deep; i++)
+				*out << CharType(' ');
+			*out << basic_literal<CharType>("</") << tag_name << basic_literal<CharType>(">\n");
+		}
+	}
+}
+
+template<typename CharType>
+void html::basic_dom<CharType>::to_html(std::basic_ostream<CharType>* out, int deep) const
+{
+	to_html_open(out, tag_name, decoded_attributes(), content_text, deep);
+
+	dom_walk(*this, [out, &deep](const basic_dom_ptr& c)
+	{
+		to_html_open(out, c->tag_name, c->decoded_attributes(), c->content_text, ++deep);
+		return walk_continue;
+	}, [out, &deep](const basic_dom<CharType>& c)
+	{
+		to_html_close(out, c.tag_name, deep--);
+	});
+
+	to_html_close(out, tag_name, deep);
+}
+
+template<typename CharType>
+std::basic_string<CharType> html::basic_dom<CharType>::to_html() const
+{
+	std::basic_stringstream<CharType> ret;
+	to_html(&ret, -1);
+	return ret.str();
+}
+
+template std::basic_string<char> html::basic_dom<char>::to_html() const;
+template std::basic_string<wchar_t> html::basic_dom<wchar_t>::to_html() const;
+template std::basic_string<char16_t> html::basic_dom<char16_t>::to_html() const;
+
+namespace html { namespace detail {
+
+	// 分词器在一次 tag 事件处的状态, 由 html_tokenizer 交给 tracks_boundaries 为 true 的 sink
+	struct tokenizer_boundary
+	{
+		std::size_t offset;		// 事件的最后一个字符之后在当前片段中的位置
+		bool ignore_blank;		// 从 offset 恢复分词时的空白折叠状态
+		bool resumable;			// 没有残留的属性 key, 也不在注释中, 可以从 offset 恢复分词
+	};
+
+	template<class Sink>
+	inline void report_boundary(Sink&, const tokenizer_boundary&, std::false_type) {}
+
+	template<class Sink>
+	inline void report_boundary(Sink& sink, const tokenizer_boundary& b, std::true_type)
+	{
+		sink.boundary(b);
+	}
+
+	// append_html_lazy 推迟建树的子树: 页面中 [begin, end) 之间的内容, 以及其中出现过的 tag 名
+	template<typename CharType>
+	struct lazy_subtree
+	{
+		std::once_flag once;
+		std::shared_ptr<const std::basic_string<CharType>> page;	// 展开后释放
+		std::size_t begin, end;
+		bool ignore_blank;
+		bool frozen = false;	// freeze() 之后展开的子树要立即解码属性, 保证之后只读
+		std::bitset<256> tags;
+
+		static std::size_t tag_bit(std::size_t h, int i)
+		{
+			return (h >> (i * 8)) % 256;
+		}
+
+		void add_tag(const std::basic_string<CharType>& tag)
+		{
+			auto h = hash_key(tag, 0, true);
+			tags.set(tag_bit(h, 0));
+			tags.set(tag_bit(h, 1));
+		}
+
+		bool might_contain_tag(const std::basic_string<CharType>& tag) const
+		{
+			auto h = hash_key(tag, 0, true);
+			return tags.test(tag_bit(h, 0)) && tags.test(tag_bit(h, 1));
+		}
+	};
+
+	// 把一个字符串作为全部输入的输入源, 读完时抛出 range_exhausted 结束分词.
+	struct range_exhausted {};
+
+	template<typename CharType>
+	class range_source
+	{
+	public:
+		explicit range_source(const std::basic_string<CharType>& range)
+			: m_range(&range)
+		{}
+
+		explicit operator bool() const { return true; }
+
+		const std::basic_string<CharType>* get() const { return m_range; }
+
+		void operator()()
+		{
+			throw range_exhausted();
+		}
+
+	private:
+		const std::basic_string<CharType>* m_range;
+	};
+
+	// 树构建阶段: 按分词阶段给出的顺序创建节点, 维护当前节点并发出节点信号.
+	template<typename CharType>
+	class tree_builder
+	{
+	public:
+		// html_tokenizer 可以把整个属性区原样交给 raw_attributes
+		static const bool lazy_attributes = true;
+		// lazy 建树需要 tag 事件的位置
+		static const bool tracks_boundaries = true;
+
+		explicit tree_builder(basic_dom<CharType>* root, const basic_parse_filter<CharType>* filter = nullptr)
+			: m_root(root)
+			, m_current(root)
+			, m_filter(filter)
+			, m_next_order(resume_order())
+			, m_first_order(m_next_order)
+		{}
+
+		// 深度达到 depth 的节点推迟建子树, 范围是 page 中的位置. page 必须是交给 html_tokenizer 的唯一片段.
+		void defer_below(std::size_t depth, const std::shared_ptr<const std::basic_string<CharType>>& page)
+		{
+			m_lazy_depth = depth;
+			m_page = page;
+		}
+
+		void boundary(const tokenizer_boundary& b)
+		{
+			m_boundary = b;
+		}
+
+		// 不会再有输入了, 还没有关闭的节点到此为止
+		void finish()
+		{
+			leave_to(m_root);
+		}
+
+		const std::basic_string<CharType>& current_tag_name() const
+		{
+			if (skipping())
+				return m_skipped[m_skipped_depth - 1];
+			if (unwrapped_innermost())
+				return m_unwrapped.back().name;
+			return m_current->tag_name;
+		}
+
+		// 文本节点
+		void text(std::basic_string<CharType>&& content)
+		{
+			if (skipping())
+				return;
+
+			auto content_node = std::make_shared<basic_dom<CharType>>(m_current);
+			content_node->content_text = std::move(content);
+			number(*content_node, true);
+			m_current->children.push_back(std::move(content_node));
+
+			emit(tag_open, m_current->children.back().get());
+			emit(tag_close, m_current->children.back().get());
+		}
+
+		// <tag 之后还有属性, 进入新节点等待属性
+		void tag_begin(std::basic_string<CharType>&& tag)
+		{
+			if (skipping() || dropped(tag))
+			{
+				note_lazy_tag(tag);
+				push_skipped(tag);
+				return;
+			}
+
+			if (unwrapped(tag))
+			{
+				m_unwrapped.push_back(unwrapped_tag{std::move(tag), m_current});
+				return;
+			}
+
+			auto new_dom = std::make_shared<basic_dom<CharType>>(m_current);
+			new_dom->tag_name = std::move(tag);
+			number(*new_dom, false);
+
+			m_current->children.push_back(std::move(new_dom));
+			m_current = m_current->children.back().get();
+		}
+
+		// 没有属性的 <tag>
+		void tag(std::basic_string<CharType>&& tag)
+		{
+			if (skipping() || dropped(tag))
+			{
+				note_lazy_tag(tag);
+				if (tag[0] != '!')
+					push_skipped(tag);
+				return;
+			}
+
+			if (unwrapped(tag))
+			{
+				m_unwrapped.push_back(unwrapped_tag{std::move(tag), m_current});
+				return;
+			}
+
+			auto new_dom = std::make_shared<basic_dom<CharType>>(m_current);
+			new_dom->tag_name = std::move(tag);
+			number(*new_dom, new_dom->tag_name[0] == '!');
+			m_current->children.push_back(std::move(new_dom));
+			if (m_current->children.back()->tag_name[0] != '!')
+			{
+				m_current = m_current->children.back().get();
+				emit(tag_open, m_current);
+				defer_children();
+			}else
+				emit(tag_open, m_current);
+		}
+
+		void attribute(const std::basic_string<CharType>& k)
+		{
+			if (!skipping() && !unwrapped_innermost())
+			{
+				auto & p = attach_pool();
+				std::lock_guard<std::mutex> lock(p.mutex());
+				p.put(m_current->attributes, k);
+			}
+		}
+
+		void attribute(const std::basic_string<CharType>& k, std::basic_string<CharType>&& v)
+		{
+			if (!skipping() && !unwrapped_innermost())
+			{
+				auto & p = attach_pool();
+				std::lock_guard<std::mutex> lock(p.mutex());
+				p.put(m_current->attributes, k, v);
+			}
+		}
+
+		// 未解码的属性区, 由 basic_dom::decoded_attributes 在第一次读取时解码
+		void raw_attributes(std::basic_string<CharType>&& raw)
+		{
+			if (!skipping() && !unwrapped_innermost())
+			{
+				attach_pool();
+				m_current->m_raw_attributes = std::move(raw);
+			}
+		}
+
+		// tag_begin 之后的 '>'
+		void tag_end()
+		{
+			if (skipping())
+			{
+				if (m_skipped[m_skipped_depth - 1][0] == '!')
+					end_skipping(m_skipped_depth - 1);
+				return;
+			}
+
+			if (unwrapped_innermost())
+				return;
+
+			emit(tag_open, m_current);
+			if (m_current->tag_name[0] == '!')
+			{
+				emit(tag_close, m_current);
+				leave_to(m_current->m_parent);
+			}else
+				defer_children();
+		}
+
+		// <tag ... />
+		void self_close()
+		{
+			if (skipping())
+			{
+				end_skipping(m_skipped_depth - 1);
+				return;
+			}
+
+			if (unwrapped_innermost())
+			{
+				m_unwrapped.pop_back();
+				return;
+			}
+
+			if (m_current->m_parent)
+			{
+				emit(tag_close, m_current);
+				leave_to(m_current->m_parent);
+			}else
+				m_current = m_root;
+		}
+
+		// </tag>
+		void close(const std::basic_string<CharType>& tag)
+		{
+			// 注意, HTML 里, tag 可以越级关闭
+			// 因此需要进行回朔查找, 先找被丢弃的部分, 再找真正的节点
+			for (auto i = m_skipped_depth; i > 0; --i)
+			{
+				if (strcmp_ignore_case(m_skipped[i - 1], tag))
+				{
+					end_skipping(i - 1);
+					return;
+				}
+			}
+
+			// 不建节点的元素夹在它打开时的当前节点与之后打开的节点之间, 由内向外交替检查
+			auto unwrapped_count = m_unwrapped.size();
+			auto _current_ptr = m_current;
+
+			while (_current_ptr)
+			{
+				if (unwrapped_count && m_unwrapped[unwrapped_count - 1].host == _current_ptr)
+				{
+					if (strcmp_ignore_case(m_unwrapped[--unwrapped_count].name, tag))
+					{
+						// 它里面打开的节点随之关闭
+						end_skipping(0);
+						leave_to(_current_ptr);
+						m_unwrapped.resize(unwrapped_count);
+						return;
+					}
+					continue;
+				}
+
+				if (strcmp_ignore_case(_current_ptr->tag_name, tag))
+					break;
+				_current_ptr = _current_ptr->m_parent;
+			}
+
+			// 找不到对应的 tag 要咋关闭... 忽略之
+			if (!_current_ptr)
+				return;
+
+			// 找到了要关闭的 tag, 那就退出本 dom 节点, 被丢弃的部分和里面不建节点的元素也随之关闭
+			end_skipping(0);
+			m_unwrapped.resize(unwrapped_count);
+			leave_to(_current_ptr);
+			self_close();
+		}
+
+		void comment(std::basic_string<CharType>&& content)
+		{
+			if (skipping() || (m_filter && !m_filter->keep_comments))
+			{
+				note_lazy_tag(comment_tag_string<CharType>());
+				return;
+			}
+
+			auto comment_node = std::make_shared<basic_dom<CharType>>(m_current);
+			comment_node->tag_name = comment_tag_string<CharType>();
+			comment_node->content_text = std::move(content);
+			number(*comment_node, true);
+			m_current->children.push_back(std::move(comment_node));
+		}
+
+		// </script> 之前的脚本内容
+		void script(std::basic_string<CharType>&& content)
+		{
+			if (skipping())
+			{
+				end_skipping(m_skipped_depth - 1);
+				return;
+			}
+
+			// 不在 keep_tags 里的 script, 内容随之丢弃
+			if (unwrapped_innermost())
+			{
+				m_unwrapped.pop_back();
+				return;
+			}
+
+			m_current->content_text = std::move(content);
+			emit(tag_close, m_current);
+			leave_to(m_current->m_parent);
+		}
+
+	private:
+		// 没有回调连接时不发信号, 也就不必为每个节点调用 shared_from_this
+		void emit(tag_stage stage, basic_dom<CharType>* node)
+		{
+			if (m_root->m_signal_connected)
+				(*m_root->m_new_node_signal)(stage, node->shared_from_this());
+		}
+
+		// 正处在被丢弃的子树里
+		bool skipping() const
+		{
+			return m_skipped_depth != 0;
+		}
+
+		// 连同子树一起丢弃
+		bool dropped(const std::basic_string<CharType>& tag) const
+		{
+			if (!m_filter)
+				return false;
+
+			for (auto & t : m_filter->drop_tags)
+				if (strcmp_ignore_case(tag, t))
+					return true;
+			return false;
+		}
+
+		// 不建节点, 但子节点照常建立, 挂到最近的保留下来的祖先上
+		bool unwrapped(const std::basic_string<CharType>& tag) const
+		{
+			if (!m_filter || m_filter->keep_tags.empty() || tag[0] == '!')
+				return false;
+
+			for (auto & t : m_filter->keep_tags)
+				if (strcmp_ignore_case(tag, t))
+					return false;
+			return true;
+		}
+
+		// 最内层打开的元素是不建节点的元素: 它打开之后没有再打开真正的节点.
+		// 这时属性, 文本和 self_close 都属于它, 与不过滤时落在 m_current 上一致
+		bool unwrapped_innermost() const
+		{
+			return !m_unwrapped.empty() && m_unwrapped.back().host == m_current;
+		}
+
+		// 被丢弃的子树里打开的 tag 名, 只用于找到丢弃部分的结束位置. 缓冲区复用.
+		void push_skipped(const std::basic_string<CharType>& tag)
+		{
+			if (m_skipped_depth == m_skipped.size())
+				m_skipped.emplace_back();
+			m_skipped[m_skipped_depth++].assign(tag);
+		}
+
+		// lazy 建树: 深度达到 m_lazy_depth 的节点只记下子树的范围, 子树的内容按丢弃处理, 直到它被关闭.
+		// <!xxx>, script 和无法从中途恢复分词的节点照常建树.
+		void defer_children()
+		{
+			if (!m_lazy_depth || !m_boundary.resumable || strcmp_ignore_case(m_current->tag_name, script_tag_string<CharType>()))
+				return;
+
+			std::size_t depth = 0;
+			for (auto n = m_current; n != m_root; n = n->m_parent)
+				depth++;
+			if (depth < m_lazy_depth)
+				return;
+
+			auto lazy = std::make_shared<lazy_subtree<CharType>>();
+			lazy->page = m_page;
+			lazy->begin = m_boundary.offset;
+			lazy->end = m_page->size();
+			lazy->ignore_blank = m_boundary.ignore_blank;
+
+			m_lazy_open = lazy.get();
+			m_lazy_node = m_current;
+			m_current->m_lazy = std::move(lazy);
+			// 展开时以这个节点为根建树, 属性要进同一个字符串池
+			attach_pool();
+			push_skipped(m_current->tag_name);
+			m_current = m_current->m_parent;
+		}
+
+		// 当前节点使用文档的字符串池. 池放在根节点上, 惰性子树的根节点上是它所在文档的池
+		string_pool<CharType>& attach_pool()
+		{
+			if (!m_root->m_pool)
+				m_root->m_pool.reset(new string_pool<CharType>());
+			if (m_current->m_pool != m_root->m_pool)
+				m_current->m_pool = m_root->m_pool;
+			return *m_root->m_pool;
+		}
+
+		void note_lazy_tag(const std::basic_string<CharType>& tag)
+		{
+			if (m_lazy_open)
+				m_lazy_open->add_tag(tag);
+		}
+
+		// 丢弃部分只剩 depth 层; 全部结束时, 正在推迟的子树的范围也到此为止
+		void end_skipping(std::size_t depth)
+		{
+			m_skipped_depth = depth;
+			if (!depth && m_lazy_open)
+			{
+				m_lazy_open->end = m_boundary.offset;
+				m_lazy_open = nullptr;
+
+				// 每个节点至少占范围里的一个字符, 展开时的编号不会超出预留的部分
+				m_next_order = std::max(m_next_order, reserved_end(*m_lazy_node) + 1);
+				m_lazy_node->m_subtree_end = m_next_order - 1;
+			}
+		}
+
+		void number(basic_dom<CharType>& node, bool leaf)
+		{
+			node.m_order = m_next_order++;
+			if (leaf)
+				node.m_subtree_end = node.m_order;
+		}
+
+		// 当前节点连同它与 to 之间的祖先都已关闭. 展开惰性子树时当前节点可能移到子树以外, 只改动本次建立的节点
+		void leave_to(basic_dom<CharType>* to)
+		{
+			for (auto n = m_current; n && n != to; n = n->m_parent)
+			{
+				if (n->m_order >= m_first_order)
+					n->m_subtree_end = m_next_order - 1;
+			}
+			m_current = to;
+		}
+
+		static std::size_t reserved_end(const basic_dom<CharType>& node)
+		{
+			return node.m_order + (node.m_lazy->end - node.m_lazy->begin);
+		}
+
+		// 接着根节点下已有的编号继续. 文档中最后的节点在沿最后一个子节点往下的路径上, 惰性子树还要算上预留的编号.
+		// 之前的解析留下的未关闭节点不会再有子节点 (新的片段从根节点开始解析), 在这里把它们关闭.
+		std::size_t resume_order()
+		{
+			std::size_t next = m_root->m_order + 1;
+			std::vector<basic_dom<CharType>*> path;
+			for (auto n = m_root; !n->children.empty(); )
+			{
+				n = n->children.back().get();
+				path.push_back(n);
+				next = std::max(next, n->m_lazy ? reserved_end(*n) + 1 : n->m_order + 1);
+			}
+
+			for (auto n : path)
+			{
+				if (n->m_subtree_end == std::size_t(-1))
+					n->m_subtree_end = next - 1;
+			}
+			return next;
+		}
+
+		basic_dom<CharType>* m_root;
+		basic_dom<CharType>* m_current;
+
+		const basic_parse_filter<CharType>* m_filter;
+		std::vector<std::basic_string<CharType>> m_skipped;
+		std::size_t m_skipped_depth = 0;
+
+		// 还没有关闭的不在 keep_tags 里的元素, host 是它打开时的当前节点
+		struct unwrapped_tag
+		{
+			std::basic_string<CharType> name;
+			basic_dom<CharType>* host;
+		};
+		std::vector<unwrapped_tag> m_unwrapped;
+
+		std::size_t m_lazy_depth = 0;
+		std::shared_ptr<const std::basic_string<CharType>> m_page;
+		lazy_subtree<CharType>* m_lazy_open = nullptr;
+		basic_dom<CharType>* m_lazy_node = nullptr;
+		tokenizer_boundary m_boundary = tokenizer_boundary();
+		std::size_t m_next_order;
+		std::size_t m_first_order;
+	};
+
+	// 分词线程交给树构建线程的一条记录, 对应 tree_builder 的一次调用.
+	template<typename CharType>
+	struct parse_event
+	{
+		enum kind_t {
+			ev_text, ev_tag_begin, ev_tag, ev_attribute, ev_attribute_value, ev_raw_attributes,
+			ev_tag_end, ev_self_close, ev_close, ev_comment, ev_script, ev_eof,
+		};
+
+		kind_t kind;
+		std::basic_string<CharType> name;
+		std::basic_string<CharType> value;
+	};
+
+	struct pipeline_cancelled {};
+
+	// 单生产者单消费者环形队列.
+	// 双方各自缓存对方的下标, 并且每 publish_interval 条记录才发布一次自己的下标,
+	// 避免每条记录都让两个核争抢同一条缓存行.
+	template<typename CharType>
+	class event_ring
+	{
+	public:
+		typedef parse_event<CharType> event_type;
+
+		event_ring()
+			: m_slots(capacity)
+		{}
+
+		// 生产者
+		void push(typename event_type::kind_t kind, std::basic_string<CharType>&& name = std::basic_string<CharType>(), std::basic_string<CharType>&& value = std::basic_string<CharType>())
+		{
+			while (m_write - m_write_limit == capacity)
+			{
+				m_write_limit = m_read_published.load(std::memory_order_acquire);
+				if (m_write - m_write_limit == capacity)
+					wait_for_consumer();
+			}
+
+			auto & slot = m_slots[m_write % capacity];
+			slot.kind = kind;
+			slot.name = std::move(name);
+			slot.value = std::move(value);
+
+			if (++m_write % publish_interval == 0)
+				m_write_published.store(m_write, std::memory_order_release);
+		}
+
+		// 生产者: 立即发布已写入的记录
+		void flush()
+		{
+			m_write_published.store(m_write, std::memory_order_release);
+		}
+
+		// 生产者: 等待消费者处理完所有已写入的记录
+		void drain()
+		{
+			flush();
+			while (m_read_published.load(std::memory_order_acquire) != m_write)
+				wait_for_consumer();
+		}
+
+		// 消费者
+		event_type& front()
+		{
+			while (m_read == m_read_limit)
+			{
+				m_read_limit = m_write_published.load(std::memory_order_acquire);
+				if (m_read == m_read_limit)
+				{
+					// 生产者出错, 不会再有记录
+					if (m_cancelled.load(std::memory_order_acquire))
+						throw pipeline_cancelled();
+					// 队列空了, 先发布读下标, drain() 可能正在等待
+					m_read_published.store(m_read, std::memory_order_release);
+					std::this_thread::yield();
+				}
+			}
+			return m_slots[m_read % capacity];
+		}
+
+		void pop()
+		{
+			if (++m_read % publish_interval == 0)
+				m_read_published.store(m_read, std::memory_order_release);
+		}
+
+		// 任何一方出错时调用, 另一方在等待时抛出 pipeline_cancelled 停下来
+		void cancel()
+		{
+			m_cancelled.store(true, std::memory_order_release);
+		}
+
+	private:
+		void wait_for_consumer()
+		{
+			if (m_cancelled.load(std::memory_order_acquire))
+				throw pipeline_cancelled();
+			std::this_thread::yield();
+		}
+
+		static const std::size_t capacity = 4096;
+		static const std::size_t publish_interval = 64;
+
+		std::vector<event_type> m_slots;
+
+		// 生产者独占
+		alignas(64) std::size_t m_write = 0;
+		std::size_t m_write_limit = 0;
+		// 消费者独占
+		alignas(64) std::size_t m_read = 0;
+		std::size_t m_read_limit = 0;
+
+		alignas(64) std::atomic<std::size_t> m_write_published{0};
+		alignas(64) std::atomic<std::size_t> m_read_published{0};
+		std::atomic<bool> m_cancelled{false};
+	};
+
+	// 分词线程使用的 sink, 把 tree_builder 的调用写入 event_ring.
+	template<typename CharType>
+	class pipeline_sink
+	{
+		typedef parse_event<CharType> event_type;
+
+	public:
+		static const bool lazy_attributes = true;
+		static const bool tracks_boundaries = false;
+
+		pipeline_sink(event_ring<CharType>& ring, const tree_builder<CharType>& builder)
+			: m_ring(ring)
+			, m_builder(builder)
+		{}
+
+		// 只有 <!xxx> 之后需要读 DOM: 等构建线程追上来再读它的当前节点
+		const std::basic_string<CharType>& current_tag_name()
+		{
+			m_ring.drain();
+			return m_builder.current_tag_name();
+		}
+
+		void text(std::basic_string<CharType>&& content) { m_ring.push(event_type::ev_text, std::move(content)); }
+		void tag_begin(std::basic_string<CharType>&& tag) { m_ring.push(event_type::ev_tag_begin, std::move(tag)); }
+		void tag(std::basic_string<CharType>&& tag) { m_ring.push(event_type::ev_tag, std::move(tag)); }
+		void attribute(const std::basic_string<CharType>& k) { m_ring.push(event_type::ev_attribute, std::basic_string<CharType>(k)); }
+		void attribute(const std::basic_string<CharType>& k, std::basic_string<CharType>&& v) { m_ring.push(event_type::ev_attribute_value, std::basic_string<CharType>(k), std::move(v)); }
+		void raw_attributes(std::basic_string<CharType>&& raw) { m_ring.push(event_type::ev_raw_attributes, std::move(raw)); }
+		void tag_end() { m_ring.push(event_type::ev_tag_end); }
+		void self_close() { m_ring.push(event_type::ev_self_close); }
+		void close(const std::basic_string<CharType>& tag) { m_ring.push(event_type::ev_close, std::basic_string<CharType>(tag)); }
+		void comment(std::basic_string<CharType>&& content) { m_ring.push(event_type::ev_comment, std::move(content)); }
+		void script(std::basic_string<CharType>&& content) { m_ring.push(event_type::ev_script, std::move(content)); }
+
+		void finish()
+		{
+			m_ring.push(event_type::ev_eof);
+			m_ring.flush();
+		}
+
+	private:
+		event_ring<CharType>& m_ring;
+		const tree_builder<CharType>& m_builder;
+	};
+
+	// basic_tokenizer 使用的 sink: 把结构组装成 basic_token 交给协程的另一端.
+	// 字符串都用 swap 交换缓冲区, 热身之后每个 token 不再分配内存.
+	template<typename CharType>
+	class token_sink
+	{
+		typedef typename boost::coroutines::asymmetric_coroutine<const basic_token<CharType>*>::push_type yield_type;
+
+	public:
+		// token 需要逐个给出属性, 不接受原始属性区
+		static const bool lazy_attributes = false;
+		static const bool tracks_boundaries = false;
+
+		token_sink(basic_token<CharType>& token, yield_type& yield)
+			: m_token(token)
+			, m_yield(yield)
+		{}
+
+		const std::basic_string<CharType>& current_tag_name() const
+		{
+			return m_depth ? m_open[m_depth - 1] : m_root_tag_name;
+		}
+
+		void text(std::basic_string<CharType>&& content)
+		{
+			flush_start_tag();
+			yield_text(token_text, content);
+		}
+
+		void tag_begin(std::basic_string<CharType>&& tag)
+		{
+			flush_start_tag();
+			start_tag(tag);
+			push_open(m_token.m_name);
+			m_pending = true;
+		}
+
+		void tag(std::basic_string<CharType>&& tag)
+		{
+			flush_start_tag();
+			start_tag(tag);
+			if (m_token.m_name[0] != '!')
+				push_open(m_token.m_name);
+			yield_start_tag(false);
+		}
+
+		void attribute(const std::basic_string<CharType>& k)
+		{
+			next_attribute().first.assign(k);
+			m_token.m_attributes[m_token.m_attribute_count - 1].second.clear();
+		}
+
+		void raw_attributes(std::basic_string<CharType>&&) {}
+
+		void attribute(const std::basic_string<CharType>& k, std::basic_string<CharType>&& v)
+		{
+			auto & attr = next_attribute();
+			attr.first.assign(k);
+			attr.second.swap(v);
+			v.clear();
+		}
+
+		void tag_end()
+		{
+			if (m_token.m_name[0] == '!')
+				pop_open();
+			yield_start_tag(false);
+		}
+
+		void self_close()
+		{
+			pop_open();
+			yield_start_tag(true);
+		}
+
+		void close(const std::basic_string<CharType>& tag)
+		{
+			flush_start_tag();
+			for (auto i = m_depth; i > 0; --i)
+			{
+				if (strcmp_ignore_case(m_open[i - 1], tag))
+				{
+					m_depth = i - 1;
+					break;
+				}
+			}
+			m_token.m_kind = token_end_tag;
+			m_token.m_name.assign(tag);
+			m_yield(&m_token);
+		}
+
+		void comment(std::basic_string<CharType>&& content)
+		{
+			flush_start_tag();
+			yield_text(token_comment, content);
+		}
+
+		// 脚本内容作为文本给出, 随后是 </script>
+		void script(std::basic_string<CharType>&& content)
+		{
+			flush_start_tag();
+			pop_open();
+			yield_text(token_text, content);
+			m_token.m_kind = token_end_tag;
+			m_token.m_name.assign(script_tag_string<CharType>());
+			m_yield(&m_token);
+		}
+
+	private:
+		// 与 tree_builder 的当前节点同步的 tag 名栈, 只用于 current_tag_name
+		void push_open(const std::basic_string<CharType>& name)
+		{
+			if (m_depth == m_open.size())
+				m_open.emplace_back();
+			m_open[m_depth++].assign(name);
+		}
+
+		void pop_open()
+		{
+			if (m_depth)
+				--m_depth;
+		}
+
+		void start_tag(std::basic_string<CharType>& tag)
+		{
+			m_token.m_name.swap(tag);
+			tag.clear();
+			m_token.m_attribute_count = 0;
+		}
+
+		std::pair<std::basic_string<CharType>, std::basic_string<CharType>>& next_attribute()
+		{
+			if (m_token.m_attribute_count == m_token.m_attributes.size())
+				m_token.m_attributes.emplace_back();
+			return m_token.m_attributes[m_token.m_attribute_count++];
+		}
+
+		void yield_start_tag(bool self_closing)
+		{
+			m_pending = false;
+			m_token.m_kind = token_start_tag;
+			m_token.m_self_closing = self_closing;
+			m_yield(&m_token);
+		}
+
+		// 属性里出现换行时 tag 没有 '>' 就结束了, 在下一个 token 之前补上
+		void flush_start_tag()
+		{
+			if (m_pending)
+				yield_start_tag(false);
+		}
+
+		void yield_text(token_kind kind, std::basic_string<CharType>& content)
+		{
+			m_token.m_kind = kind;
+			m_token.m_text.swap(content);
+			content.clear();
+			m_yield(&m_token);
+		}
+
+		basic_token<CharType>& m_token;
+		yield_type& m_yield;
+		bool m_pending = false;
+		std::vector<std::basic_string<CharType>> m_open;
+		std::size_t m_depth = 0;
+		const std::basic_string<CharType> m_root_tag_name;
+	};
+
+	// 一次给出整个页面的输入源. 页面读完后通知 basic_tokenizer 结束, 此后不会再被恢复.
+	template<typename CharType>
+	class whole_page_source
+	{
+		typedef typename boost::coroutines::asymmetric_coroutine<const basic_token<CharType>*>::push_type yield_type;
+
+	public:
+		whole_page_source(const std::basic_string<CharType>& page, yield_type& yield)
+			: m_page(&page)
+			, m_yield(yield)
+		{}
+
+		explicit operator bool() const { return true; }
+
+		const std::basic_string<CharType>* get() const { return m_page; }
+
+		void operator()()
+		{
+			m_yield(nullptr);
+		}
+
+	private:
+		const std::basic_string<CharType>* m_page;
+		yield_type& m_yield;
+	};
+
+	// 树构建线程: 依次取出记录交给 tree_builder, 直到 ev_eof
+	template<typename CharType>
+	void build_from_ring(event_ring<CharType>& ring, tree_builder<CharType>& builder)
+	{
+		typedef parse_event<CharType> event_type;
+
+		for (;;)
+		{
+			auto & ev = ring.front();
+
+			switch (ev.kind)
+			{
+				case event_type::ev_text: builder.text(std::move(ev.name)); break;
+				case event_type::ev_tag_begin: builder.tag_begin(std::move(ev.name)); break;
+				case event_type::ev_tag: builder.tag(std::move(ev.name)); break;
+				case event_type::ev_attribute: builder.attribute(ev.name); break;
+				case event_type::ev_attribute_value: builder.attribute(ev.name, std::move(ev.value)); break;
+				case event_type::ev_raw_attributes: builder.raw_attributes(std::move(ev.name)); break;
+				case event_type::ev_tag_end: builder.tag_end(); break;
+				case event_type::ev_self_close: builder.self_close(); break;
+				case event_type::ev_close: builder.close(ev.name); break;
+				case event_type::ev_comment: builder.comment(std::move(ev.name)); break;
+				case event_type::ev_script: builder.script(std::move(ev.name)); break;
+				case event_type::ev_eof:
+					return;
+			}
+
+			ring.pop();
+		}
+	}
+}}
+
+#define CASE_BLANK case ' ': case '\r': case '\n': case '\t'
+
+namespace html { namespace detail {
+
+// 只定位属性区的结尾, 不保留任何内容
+template<typename CharType>
+struct attribute_skipper
+{
+	std::basic_string<CharType>* key() { return nullptr; }
+	std::basic_string<CharType>* value() { return nullptr; }
+	void attribute() {}
+	void attribute_value() {}
+};
+
+// 解码延迟保存的属性区, 写入方式与 tree_builder::attribute 相同
+template<typename CharType, typename AttributeMap>
+struct attribute_collector
+{
+	AttributeMap& attributes;
+	string_pool<CharType>& pool;
+	std::basic_string<CharType> k, v;
+
+	attribute_collector(AttributeMap& attributes, string_pool<CharType>& pool)
+		: attributes(attributes)
+		, pool(pool)
+	{}
+
+	std::basic_string<CharType>* key() { return &k; }
+	std::basic_string<CharType>* value() { return &v; }
+	void attribute() { pool.put(attributes, k); k.clear(); }
+	void attribute_value() { pool.put(attributes, k, v); k.clear(); v.clear(); }
+};
+
+// html_tokenizer 中 get_string 的逐字节等价版本: 返回指向结束引号或换行的迭代器, 不够时返回 last.
+// 双引号内的 ' 连同它后面的一个字符都被丢弃.
+template<typename CharType, class Iterator>
+Iterator scan_quoted(Iterator first, Iterator last, CharType quote_char, std::basic_string<CharType>* out)
+{
+	if (out)
+		out->clear();
+
+	for (; first != last; ++first)
+	{
+		auto c = *first;
+		if (c == quote_char || c == '\n')
+			return first;
+
+		if (c == '\'')
+		{
+			if (++first == last)
+				return last;
+		}else if (out)
+			*out += c;
+	}
+	return last;
+}
+
+// html_tokenizer 状态 2~4 的逐字节等价版本, 从 tag 名之后的第一个字符开始运行.
+// 返回指向结束属性区的 '>' 或 '/' 的迭代器, state 为此时的状态 (2, 3 或 4), 状态 3, 4 中未提交的属性留在 sink 里.
+// 在 last 之前没有结束, 或者遇到引号内的 key 碰上换行 (html_tokenizer 会回到状态 0) 时返回 last.
+template<typename CharType, class Iterator, class Sink>
+Iterator scan_attributes(Iterator first, Iterator last, int& state, Sink& sink)
+{
+	state = 2;
+
+	for (; first != last; ++first)
+	{
+		CharType c = *first;
+
+		switch (state)
+		{
+			case 2:
+			{
+				switch (c)
+				{
+					CASE_BLANK :
+					break;
+					case '>':
+					case '/':
+						return first;
+					case '\"':
+					case '\'':
+					{
+						first = scan_quoted(first + 1, last, c, sink.key());
+						if (first == last || *first == '\n')
+							return last;
+						state = 3;
+					}break;
+					default:
+						state = 3;
+						if (auto k = sink.key())
+							*k += c;
+				}
+			}break;
+			case 3:
+			{
+				switch (c)
+				{
+					CASE_BLANK :
+					{
+						state = 2;
+						sink.attribute();
+					}break;
+					case '=':
+						state = 4;
+					break;
+					case '>':
+						return first;
+					default:
+						if (auto k = sink.key())
+							*k += c;
+				}
+			}break;
+			case 4:
+			{
+				switch (c)
+				{
+					case '\"':
+					case '\'':
+					{
+						// 引号内的换行与结束引号一样结束这个值
+						first = scan_quoted(first + 1, last, c, sink.value());
+						if (first == last)
+							return last;
+					}
+					CASE_BLANK :
+					{
+						state = 2;
+						sink.attribute_value();
+					}break;
+					case '>':
+						return first;
+					default:
+						if (auto v = sink.value())
+							*v += c;
+				}
+			}break;
+		}
+	}
+	return last;
+}
+
+// 分词阶段: 逐字符驱动状态机, 把识别出的结构交给 sink (tree_builder, pipeline_sink 或 token_sink).
+// 除了 <!xxx> 之后判断父节点是否为 script 以外, 不读取 DOM.
+// sink 可以取走也可以不取走以右值传入的字符串, 传入后总是清空.
+// html_page_source 通常是协程的 pull_type, 需要提供 get(), operator() 和 operator bool.
+// ignore_blank 是从页面中途恢复分词时 (惰性子树) 上一段文本留下的空白折叠状态.
+template<typename CharType, class Source, class Sink>
+void html_tokenizer(Source& html_page_source, Sink& sink, bool ignore_blank = false)
+{
+	int pre_state = 0, state = 0;
+
+	const std::basic_string<CharType> * _cur_str;
+	typename std::basic_string<CharType>::const_iterator _cur_str_it;
+
+	_cur_str = html_page_source.get();
+
+	_cur_str_it = _cur_str->begin();
+
+	auto getc = [&_cur_str, &_cur_str_it, &html_page_source](){
+
+		if (_cur_str_it!= _cur_str->end())
+		{
+			return *_cur_str_it++;
+		}
+
+		html_page_source();
+		_cur_str = html_page_source.get();
+		_cur_str_it = _cur_str->begin();
+
+		return *_cur_str_it++;
+	};
+
+	auto get_escape = [&getc]() -> CharType
+	{
+		return getc();
+	};
+
+	// 读入引号内的字符串, 复用 ret 的缓冲区
+	auto get_string = [&getc, &get_escape, &pre_state, &state](CharType quote_char, std::basic_string<CharType>& ret)
+	{
+		ret.clear();
+
+		auto c = getc();
+
+		while ( (c != quote_char) && (c!= '\n'))
+		{
+			if ( c == '\'' )
+			{
+				c += get_escape();
+			}else
+			{
+				ret += c;
+			}
+			c = getc();
+		}
+
+		if (c == '\n')
+		{
+			pre_state = state;
+			state = 0;
+
+		}
+	};
+
+	std::basic_string<CharType> tag; //当前处理的 tag
+	std::basic_string<CharType> content; // 当前 tag 下的内容
+	std::basic_string<CharType> k,v;
+
+	CharType c;
+
+	std::vector<int> comment_stack;
+
+	// tag 事件之前告诉需要的 sink (lazy 建树) 事件在当前片段中的结束位置, 以及能否从这里恢复分词
+	auto boundary = [&]()
+	{
+		report_boundary(sink, tokenizer_boundary{std::size_t(_cur_str_it - _cur_str->begin()), ignore_blank, k.empty() && comment_stack.empty()},
+			std::integral_constant<bool, Sink::tracks_boundaries>());
+	};
+
+	// 正在解析属性的 tag 是否为 script
+	bool script_tag = false;
+
+	while(html_page_source) // EOF 检测
 	{
 		// 获取一个字符
 		c = getc();
@@ -835,12 +3016,8 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 							state = 1;
 							if (!content.empty())
 							{
-								auto content_node = std::make_shared<basic_dom<CharType>>(current_ptr);
-								content_node->content_text = std::move(content);
-								current_ptr->children.push_back(std::move(content_node));
-
-								m_new_node_signal(tag_open, content_node);
-								m_new_node_signal(tag_close, content_node);
+								sink.text(std::move(content));
+								content.clear();
 							}
 						}
 					}
@@ -877,11 +3054,44 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 						{
 							pre_state = state;
 							state = 2;
-							auto new_dom = std::make_shared<basic_dom<CharType>>(current_ptr);
-							new_dom->tag_name = std::move(tag);
+							script_tag = strcmp_ignore_case(tag, script_tag_string<CharType>());
+							sink.tag_begin(std::move(tag));
+							tag.clear();
+
+							// 属性区整个落在当前片段内时只定位它的结尾, 原始字节交给 sink, 第一次读取属性时再解码.
+							// k 不为空是引号内的 key 遇到换行留下的残余, 只有逐字符解析能复现.
+							if (Sink::lazy_attributes && k.empty())
+							{
+								attribute_skipper<CharType> skipper;
+								auto end = scan_attributes<CharType>(_cur_str_it, _cur_str->end(), state, skipper);
 
-							current_ptr->children.push_back(new_dom);
-							current_ptr = new_dom.get();
+								if (end != _cur_str->end())
+								{
+									sink.raw_attributes(std::basic_string<CharType>(_cur_str_it, end));
+									_cur_str_it = end + 1;
+									pre_state = state;
+									state = 0;
+
+									if (*end == '/')
+									{
+										// 与状态 2 相同, 下一个字符无论是什么都被当作 '>'
+										getc();
+										boundary();
+										sink.self_close();
+									}else
+									{
+										boundary();
+										sink.tag_end();
+										if (script_tag)
+										{
+											state = 20;
+										}
+									}
+								}else
+								{
+									state = 2;
+								}
+							}
 						}
 					}
 					break;
@@ -890,16 +3100,15 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 						pre_state = state;
 						state = 0;
 
-						auto new_dom = std::make_shared<basic_dom<CharType>>(current_ptr);
-						new_dom->tag_name = std::move(tag);
-						current_ptr->children.push_back(new_dom);
-						if(new_dom->tag_name[0] != '!')
-							current_ptr = new_dom.get();
-						if (strcmp_ignore_case(current_ptr->tag_name, script_tag_string<CharType>()))
+						// <!xxx> 不会成为当前节点, 此时判断的是它的父节点
+						if (tag[0] != '!' ? strcmp_ignore_case(tag, script_tag_string<CharType>())
+							: strcmp_ignore_case(sink.current_tag_name(), script_tag_string<CharType>()))
 						{
 							state = 20;
 						}
-						m_new_node_signal(tag_open, current_ptr->shared_from_this());
+						boundary();
+						sink.tag(std::move(tag));
+						tag.clear();
 					}
 					break;
 					case '/':
@@ -926,12 +3135,9 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 						// tag 解析完毕, 正式进入 下一个 tag
 						pre_state = state;
 						state = 0;
-						m_new_node_signal(tag_open, current_ptr->shared_from_this());
-						if ( current_ptr->tag_name[0] == '!')
-						{
-							m_new_node_signal(tag_close, current_ptr->shared_from_this());
-							current_ptr = current_ptr->m_parent;
-						}else if (strcmp_ignore_case(current_ptr->tag_name, script_tag_string<CharType>()))
+						boundary();
+						sink.tag_end();
+						if (script_tag)
 						{
 							state = 20;
 						}
@@ -951,19 +3157,15 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 						pre_state = state;
 						state = 0;
 
-						if (current_ptr->m_parent)
-						{
-							m_new_node_signal(tag_close, current_ptr->shared_from_this());
-							current_ptr = current_ptr->m_parent;
-						}else
-							current_ptr = this;
+						boundary();
+						sink.self_close();
 					}break;
 					case '\"':
 					case '\'':
 					{
 						pre_state = state;
 						state = 3;
-						k = get_string(c);
+						get_string(c, k);
 					}break;
 					default:
 						pre_state = state;
@@ -979,7 +3181,7 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 					{
 						// empty k=v
 						state = 2;
-						current_ptr->attributes[k];
+						sink.attribute(k);
 						k.clear();
 						v.clear();
 					}
@@ -993,17 +3195,12 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 					{
 						pre_state = state;
 						state = 0;
-						current_ptr->attributes[k];
+						sink.attribute(k);
 						k.clear();
 						v.clear();
-						m_new_node_signal(tag_open, current_ptr->shared_from_this());
-						if ( current_ptr->tag_name[0] == '!')
-						{
- 							m_new_node_signal(tag_close, current_ptr->shared_from_this());
-
-							current_ptr = current_ptr->m_parent;
-
-						}else if (strcmp_ignore_case(current_ptr->tag_name, script_tag_string<CharType>()))
+						boundary();
+						sink.tag_end();
+						if (script_tag)
 						{
 							state = 20;
 						}
@@ -1020,30 +3217,29 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 					case '\"':
 					case '\'':
 					{
-						v = get_string(c);
+						get_string(c, v);
 					}
 					CASE_BLANK :
 					{
 						state = 2;
-						current_ptr->attributes[k] = std::move(v);
+						sink.attribute(k, std::move(v));
+						v.clear();
 						k.clear();
 					}
 					break;
 					case '>':
 					{
+						// 没有引号的值直接以 '>' 结束
 						pre_state = state;
 						state = 0;
-						current_ptr->attributes[k];
+						sink.attribute(k, std::move(v));
 						k.clear();
 						v.clear();
 
-						m_new_node_signal(tag_open, current_ptr->shared_from_this());
+						boundary();
+						sink.tag_end();
 
-						if ( current_ptr->tag_name[0] == '!')
-						{
-							m_new_node_signal(tag_close, current_ptr->shared_from_this());
-							current_ptr = current_ptr->m_parent;
-						}else if (strcmp_ignore_case(current_ptr->tag_name, script_tag_string<CharType>()))
+						if (script_tag)
 						{
 							state = 20;
 						}
@@ -1063,39 +3259,9 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 						{
 							state = 0;
 							// 来, 关闭 tag 了
-							// 注意, HTML 里, tag 可以越级关闭
-
-							// 因此需要进行回朔查找
-
-							auto _current_ptr = current_ptr;
-
-							while (_current_ptr && !strcmp_ignore_case(_current_ptr->tag_name, tag))
-							{
-								_current_ptr = _current_ptr->m_parent;
-							}
-
-							if (!_current_ptr)
-							{
-								// 找不到对应的 tag 要咋关闭... 忽略之
-								tag.clear();
-
-								break;
-							}
-
+							boundary();
+							sink.close(tag);
 							tag.clear();
-
-							current_ptr = _current_ptr;
-
-							// 找到了要关闭的 tag
-
-							// 那就退出本 dom 节点
-							if (current_ptr->m_parent)
-							{
-								m_new_node_signal(tag_close, current_ptr->shared_from_this());
-								current_ptr = current_ptr->m_parent;
-							}
-							else
-								current_ptr = this;
 						}else
 						{
 							state = 0;
@@ -1193,10 +3359,8 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 							content.pop_back();
 						comment_stack.pop_back();
 						state = comment_stack.empty()? 0 : 12;
-						auto comment_node = std::make_shared<basic_dom<CharType>>(current_ptr);
-						comment_node->tag_name = comment_tag_string<CharType>();
-						comment_node->content_text = std::move(content);
-						current_ptr->children.push_back(comment_node);
+						sink.comment(std::move(content));
+						content.clear();
 					}break;
 					default:
 						content += c;
@@ -1332,9 +3496,9 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 						{
 							for (int i =0 ; i < 8 ;i++)
 								content.pop_back();
-							current_ptr->content_text = std::move(content);
-							m_new_node_signal(tag_close, current_ptr->shared_from_this());
-							current_ptr = current_ptr->m_parent;
+							boundary();
+							sink.script(std::move(content));
+							content.clear();
 						}
 					}break;
 					default:
@@ -1346,7 +3510,391 @@ void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetr
 	}
 }
 
+}} // namespace html::detail
+
+template<typename CharType>
+void html::basic_dom<CharType>::html_parser(typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::pull_type& html_page_source, std::shared_ptr<const basic_parse_filter<CharType>> filter)
+{
+	detail::tree_builder<CharType> builder(this, filter.get());
+	detail::html_tokenizer<CharType>(html_page_source, builder);
+}
+
+template<typename CharType>
+const typename html::basic_dom<CharType>::attribute_map& html::basic_dom<CharType>::decoded_attributes() const
+{
+	if (!m_raw_attributes.empty())
+	{
+		std::basic_string<CharType> raw;
+		raw.swap(m_raw_attributes);
+
+		// raw 停在结束属性区的字符之前, 状态 3, 4 里还没提交的属性由该字符提交
+		std::lock_guard<std::mutex> lock(m_pool->mutex());
+		detail::attribute_collector<CharType, attribute_map> collector{attributes, *m_pool};
+		int state;
+		detail::scan_attributes<CharType>(raw.cbegin(), raw.cend(), state, collector);
+		if (state == 3)
+			collector.attribute();
+		else if (state == 4)
+			collector.attribute_value();
+	}
+	return attributes;
+}
+
 #undef CASE_BLANK
 
-template void html::basic_dom<char>::html_parser(boost::coroutines::asymmetric_coroutine<const std::basic_string<char>*>::pull_type& html_page_source);
-template void html::basic_dom<wchar_t>::html_parser(boost::coroutines::asymmetric_coroutine<const std::basic_string<wchar_t>*>::pull_type& html_page_source);
+template const html::basic_dom<char>::attribute_map& html::basic_dom<char>::decoded_attributes() const;
+template const html::basic_dom<wchar_t>::attribute_map& html::basic_dom<wchar_t>::decoded_attributes() const;
+template const html::basic_dom<char16_t>::attribute_map& html::basic_dom<char16_t>::decoded_attributes() const;
+
+template void html::basic_dom<char>::html_parser(boost::coroutines::asymmetric_coroutine<const std::basic_string<char>*>::pull_type& html_page_source, std::shared_ptr<const basic_parse_filter<char>> filter);
+template void html::basic_dom<wchar_t>::html_parser(boost::coroutines::asymmetric_coroutine<const std::basic_string<wchar_t>*>::pull_type& html_page_source, std::shared_ptr<const basic_parse_filter<wchar_t>> filter);
+template void html::basic_dom<char16_t>::html_parser(boost::coroutines::asymmetric_coroutine<const std::basic_string<char16_t>*>::pull_type& html_page_source, std::shared_ptr<const basic_parse_filter<char16_t>> filter);
+
+template<typename CharType>
+void html::basic_dom<CharType>::append_html_pipelined(const std::basic_string<CharType>& html_page, std::size_t serial_threshold)
+{
+	// 增量解析进行中时分词状态在协程里, 只能继续串行解析
+	if (m_frozen || html_parser_feeder_inialized || html_page.size() < serial_threshold
+		|| (serial_threshold != 0 && std::thread::hardware_concurrency() < 2))
+	{
+		append_partial_html(html_page);
+		return;
+	}
+
+	detail::event_ring<CharType> ring;
+	detail::tree_builder<CharType> builder(this);
+
+	// 分词线程的异常不能离开线程, 先保存下来, join 之后在调用线程上重新抛出
+	std::exception_ptr tokenizer_error;
+
+	std::thread tokenizer([&ring, &builder, &html_page, &tokenizer_error]()
+	{
+		try
+		{
+			detail::pipeline_sink<CharType> sink(ring, builder);
+			{
+				typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::push_type feeder(
+					[&sink](typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::pull_type& source)
+					{
+						detail::html_tokenizer<CharType>(source, sink);
+					}
+				);
+				// 协程停在页面末尾等待更多输入, 销毁它即丢弃未完成的 tag, 与 append_partial_html 一致
+				feeder(&html_page);
+			}
+			sink.finish();
+		}
+		catch (const detail::pipeline_cancelled&)
+		{
+			// 构建线程出错, 由它抛出自己的异常
+		}
+		catch (...)
+		{
+			tokenizer_error = std::current_exception();
+			ring.cancel();
+		}
+	});
+
+	try
+	{
+		detail::build_from_ring(ring, builder);
+	}
+	catch (const detail::pipeline_cancelled&)
+	{
+		// 分词线程出错, join 之后抛出它的异常
+	}
+	catch (...)
+	{
+		ring.cancel();
+		tokenizer.join();
+		throw;
+	}
+
+	tokenizer.join();
+
+	if (tokenizer_error)
+		std::rethrow_exception(tokenizer_error);
+}
+
+template void html::basic_dom<char>::append_html_pipelined(const std::basic_string<char>& html_page, std::size_t serial_threshold);
+template void html::basic_dom<wchar_t>::append_html_pipelined(const std::basic_string<wchar_t>& html_page, std::size_t serial_threshold);
+template void html::basic_dom<char16_t>::append_html_pipelined(const std::basic_string<char16_t>& html_page, std::size_t serial_threshold);
+
+template<typename CharType>
+void html::basic_dom<CharType>::append_html_lazy(const std::basic_string<CharType>& html_page, std::size_t eager_depth)
+{
+	if (m_frozen || html_parser_feeder_inialized || eager_depth == 0)
+	{
+		append_partial_html(html_page);
+		return;
+	}
+
+	auto page = std::make_shared<const std::basic_string<CharType>>(html_page);
+
+	detail::tree_builder<CharType> builder(this);
+	builder.defer_below(eager_depth, page);
+
+	detail::range_source<CharType> source(*page);
+	try
+	{
+		detail::html_tokenizer<CharType>(source, builder);
+	}
+	catch (const detail::range_exhausted&)
+	{
+	}
+}
+
+template void html::basic_dom<char>::append_html_lazy(const std::basic_string<char>& html_page, std::size_t eager_depth);
+template void html::basic_dom<wchar_t>::append_html_lazy(const std::basic_string<wchar_t>& html_page, std::size_t eager_depth);
+template void html::basic_dom<char16_t>::append_html_lazy(const std::basic_string<char16_t>& html_page, std::size_t eager_depth);
+
+template<typename CharType>
+void html::basic_dom<CharType>::materialize() const
+{
+	auto & lazy = *m_lazy;
+
+	std::call_once(lazy.once, [this, &lazy]()
+	{
+		// 范围从节点的开始 tag 之后到结束它的那个 tag 为止, 重新分词时状态与第一遍在这里时相同.
+		// 结束 tag 可能关闭更外层的节点, 这时 tree_builder 只移动当前节点指针, 不写入子树以外的节点.
+		std::basic_string<CharType> range(lazy.page->begin() + lazy.begin, lazy.page->begin() + lazy.end);
+
+		auto self = const_cast<basic_dom<CharType>*>(this);
+		detail::tree_builder<CharType> builder(self);
+		detail::range_source<CharType> source(range);
+		try
+		{
+			detail::html_tokenizer<CharType>(source, builder, lazy.ignore_blank);
+		}
+		catch (const detail::range_exhausted&)
+		{
+		}
+		catch (...)
+		{
+			// call_once 会让下一次访问重试
+			children.clear();
+			throw;
+		}
+		builder.finish();
+
+		lazy.page.reset();
+
+		// 冻结之后展开的子树同样立即解码属性并收紧容量. 新节点都不是惰性的, 不能用会调用 get_children 的 dom_walk
+		if (lazy.frozen)
+		{
+			std::vector<const basic_dom<CharType>*> stack(1, this);
+			while (!stack.empty())
+			{
+				auto d = stack.back();
+				stack.pop_back();
+
+				d->decoded_attributes();
+				d->children.shrink_to_fit();
+				for (auto & c : d->children)
+					stack.push_back(c.get());
+			}
+		}
+	});
+}
+
+template void html::basic_dom<char>::materialize() const;
+template void html::basic_dom<wchar_t>::materialize() const;
+template void html::basic_dom<char16_t>::materialize() const;
+
+template<typename CharType>
+bool html::basic_dom<CharType>::may_contain(const typename basic_selector<CharType>::selector_matcher& matcher) const
+{
+	if (!m_lazy)
+		return true;
+
+	return may_contain(matcher.required_tag_name());
+}
+
+template<typename CharType>
+bool html::basic_dom<CharType>::may_contain(const std::basic_string<CharType>* tag_name) const
+{
+	return !m_lazy || !tag_name || m_lazy->might_contain_tag(*tag_name);
+}
+
+template bool html::basic_dom<char>::may_contain(const std::basic_string<char>* tag_name) const;
+template bool html::basic_dom<wchar_t>::may_contain(const std::basic_string<wchar_t>* tag_name) const;
+template bool html::basic_dom<char16_t>::may_contain(const std::basic_string<char16_t>* tag_name) const;
+
+template<typename CharType>
+html::basic_tokenizer<CharType>::basic_tokenizer(const std::basic_string<CharType>& html_page)
+	: m_tokens([this, &html_page](typename boost::coroutines::asymmetric_coroutine<const basic_token<CharType>*>::push_type& yield)
+	{
+		detail::whole_page_source<CharType> source(html_page, yield);
+		detail::token_sink<CharType> sink(m_token, yield);
+		detail::html_tokenizer<CharType>(source, sink);
+	})
+{
+}
+
+template html::basic_tokenizer<char>::basic_tokenizer(const std::basic_string<char>& html_page);
+template html::basic_tokenizer<wchar_t>::basic_tokenizer(const std::basic_string<wchar_t>& html_page);
+template html::basic_tokenizer<char16_t>::basic_tokenizer(const std::basic_string<char16_t>& html_page);
+
+template<typename CharType>
+const html::basic_token<CharType>* html::basic_tokenizer<CharType>::next()
+{
+	if (m_finished || !m_tokens)
+		return nullptr;
+
+	if (m_started)
+		m_tokens();
+	m_started = true;
+
+	auto token = m_tokens.get();
+	m_finished = !token;
+	return token;
+}
+
+template const html::basic_token<char>* html::basic_tokenizer<char>::next();
+template const html::basic_token<wchar_t>* html::basic_tokenizer<wchar_t>::next();
+template const html::basic_token<char16_t>* html::basic_tokenizer<char16_t>::next();
+
+// 与 ASCII 字面量比较, 避免为每种 CharType 准备字符串常量
+template<typename CharType>
+static bool equals_ascii(const std::basic_string<CharType>& s, const char* literal, bool ignore_case)
+{
+	std::size_t i = 0;
+	for (; literal[i]; i++)
+	{
+		if (i == s.size())
+			return false;
+
+		CharType c = s[i];
+		if (ignore_case && c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != static_cast<CharType>(literal[i]))
+			return false;
+	}
+	return i == s.size();
+}
+
+// MIME 类型去掉 ';' 之后的参数和两端的 ASCII 空白后是否等于 literal, 不区分大小写, 与浏览器判断 script 类型的方式一致
+template<typename CharType>
+static bool mime_essence_equals(const std::basic_string<CharType>& type, const char* literal)
+{
+	auto blank = [](CharType c) { return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r'; };
+
+	std::size_t begin = 0;
+	std::size_t end = std::min(type.find(CharType(';')), type.size());
+	while (begin < end && blank(type[begin]))
+		begin++;
+	while (end > begin && blank(type[end - 1]))
+		end--;
+
+	return equals_ascii(type.substr(begin, end - begin), literal, true);
+}
+
+// 属性名不区分大小写, 同名属性以最后一个为准, 没有时返回 nullptr
+template<typename CharType>
+static const std::basic_string<CharType>* token_attribute(const html::basic_token<CharType>& token, const char* name)
+{
+	for (auto i = token.attribute_count(); i > 0; --i)
+	{
+		if (equals_ascii(token.attribute_name(i - 1), name, true))
+			return &token.attribute_value(i - 1);
+	}
+	return nullptr;
+}
+
+template<typename CharType>
+static void assign_token_attribute(std::basic_string<CharType>& target, const html::basic_token<CharType>& token, const char* name)
+{
+	if (auto value = token_attribute(token, name))
+		target = *value;
+}
+
+template<typename CharType>
+void html::extract_links(const std::basic_string<CharType>& html_page, std::vector<basic_link<CharType>>& out)
+{
+	basic_tokenizer<CharType> tokens(html_page);
+
+	while (auto token = tokens.next())
+	{
+		if (token->kind() != token_start_tag)
+			continue;
+
+		const char* url_attr;
+		if (equals_ascii(token->name(), "a", true) || equals_ascii(token->name(), "link", true))
+			url_attr = "href";
+		else if (equals_ascii(token->name(), "img", true))
+			url_attr = "src";
+		else
+			continue;
+
+		auto url = token_attribute(*token, url_attr);
+		if (!url)
+			continue;
+
+		out.emplace_back();
+		out.back().tag_name = token->name();
+		out.back().url = *url;
+		assign_token_attribute(out.back().rel, *token, "rel");
+	}
+}
+
+template void html::extract_links(const std::basic_string<char>& html_page, std::vector<basic_link<char>>& out);
+template void html::extract_links(const std::basic_string<wchar_t>& html_page, std::vector<basic_link<wchar_t>>& out);
+template void html::extract_links(const std::basic_string<char16_t>& html_page, std::vector<basic_link<char16_t>>& out);
+
+template<typename CharType>
+void html::extract_meta(const std::basic_string<CharType>& html_page, std::vector<basic_meta<CharType>>& out)
+{
+	basic_tokenizer<CharType> tokens(html_page);
+
+	while (auto token = tokens.next())
+	{
+		if (token->kind() != token_start_tag || !equals_ascii(token->name(), "meta", true))
+			continue;
+
+		out.emplace_back();
+		auto & meta = out.back();
+		assign_token_attribute(meta.name, *token, "name");
+		assign_token_attribute(meta.property, *token, "property");
+		assign_token_attribute(meta.http_equiv, *token, "http-equiv");
+		assign_token_attribute(meta.content, *token, "content");
+		assign_token_attribute(meta.charset, *token, "charset");
+	}
+}
+
+template void html::extract_meta(const std::basic_string<char>& html_page, std::vector<basic_meta<char>>& out);
+template void html::extract_meta(const std::basic_string<wchar_t>& html_page, std::vector<basic_meta<wchar_t>>& out);
+template void html::extract_meta(const std::basic_string<char16_t>& html_page, std::vector<basic_meta<char16_t>>& out);
+
+template<typename CharType>
+void html::extract_json_ld(const std::basic_string<CharType>& html_page, std::vector<std::basic_string<CharType>>& out)
+{
+	basic_tokenizer<CharType> tokens(html_page);
+
+	bool in_json_ld = false;
+
+	while (auto token = tokens.next())
+	{
+		switch (token->kind())
+		{
+			case token_start_tag:
+			{
+				auto type = token_attribute(*token, "type");
+				in_json_ld = type && equals_ascii(token->name(), script_tag_string<char>(), true)
+					&& mime_essence_equals(*type, "application/ld+json");
+			}break;
+			case token_text:
+			{
+				// script 的内容紧跟在 start tag 之后
+				if (in_json_ld)
+					out.push_back(token->text());
+				in_json_ld = false;
+			}break;
+			default:
+				in_json_ld = false;
+		}
+	}
+}
+
+template void html::extract_json_ld(const std::basic_string<char>& html_page, std::vector<std::basic_string<char>>& out);
+template void html::extract_json_ld(const std::basic_string<wchar_t>& html_page, std::vector<std::basic_string<wchar_t>>& out);
+template void html::extract_json_ld(const std::basic_string<char16_t>& html_page, std::vector<std::basic_string<char16_t>>& out);
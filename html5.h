@@ -1,9 +1,12 @@
 ﻿
 #pragma once
 
+#include <cctype>
+#include <cwctype>
 #include <type_traits>
 #include <memory>
 #include <functional>
+#include <algorithm>
 
 #include <string>
 #include <vector>
@@ -12,6 +15,7 @@
 #include <boost/coroutine/asymmetric_coroutine.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/proto/traits.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
 
 #ifdef _MSC_VER
 #	define noexcept throw()
@@ -21,7 +25,26 @@ namespace html{
 
 	template<typename CharType>
 	class basic_dom;
-	namespace detail { template<typename CharType> class basic_dom_node_parser;}
+	namespace detail {
+		template<typename CharType> class basic_dom_node_parser;
+		template<typename CharType> class ancestor_filter;
+		template<typename CharType> class tree_builder;
+		template<typename CharType> class token_sink;
+		template<typename CharType> struct lazy_subtree;
+		template<typename CharType> class string_pool;
+		template<typename CharType> void intrusive_ptr_add_ref(string_pool<CharType>*);
+		template<typename CharType> void intrusive_ptr_release(string_pool<CharType>*);
+
+		// 按内容比较字符串池中的属性名, 同一文档里相同的属性名是同一个对象, 可以直接判等
+		template<typename CharType>
+		struct pooled_less
+		{
+			bool operator()(const std::basic_string<CharType>* a, const std::basic_string<CharType>* b) const
+			{
+				return a != b && *a < *b;
+			}
+		};
+	}
 
 	template<typename CharType>
 	class basic_selector
@@ -41,6 +64,7 @@ namespace html{
 
 		friend class basic_dom<CharType>;
 		friend class detail::basic_dom_node_parser<CharType>;
+		friend class detail::ancestor_filter<CharType>;
 
 	protected:
 		struct condition
@@ -48,25 +72,45 @@ namespace html{
 			std::basic_string<CharType> matching_tag_name;
 			std::basic_string<CharType> matching_id;
 			std::basic_string<CharType> matching_class;
-			std::basic_string<CharType> matching_name;
-			std::basic_string<CharType> matching_index;
 			std::basic_string<CharType> matching_attr;
 			std::basic_string<CharType> matching_attr_value;
 			std::basic_string<CharType> matching_attr_operator;
 
 			// 判断 basic_dom<CharType> 是否与当前的 condition 一致
-			bool operator()(const basic_dom<CharType>&, int&) const;
+			bool operator()(const basic_dom<CharType>&) const;
 		};
 
 		struct selector_matcher{
 			// 轮询 m_conditions ，判断是否存在与该 basic_dom 对象一致的 condition
 			bool operator()(const basic_dom<CharType>&) const;
 
+			enum key_kind { key_none, key_id, key_class, key_tag };
+
+			// 匹配成功的必要条件: 节点的 id / class 属性或 tag 名 (不区分大小写) 必须等于 key.
+			// 按 id > class > tag 的区分度选取, 都没有时返回 key_none.
+			key_kind required_key(const std::basic_string<CharType>*& key) const;
+
+			// 匹配成功时节点的 tag 名 (不区分大小写) 必须等于的值, 没有这个条件时返回 nullptr.
+			const std::basic_string<CharType>* required_tag_name() const;
+
+			// :first, :last, :eq(n), :lt(n), :gt(n) 按位置筛选这一级的全部匹配结果 (文档顺序, 从 1 开始数)
+			enum position_kind { position_any, position_eq, position_lt, position_gt, position_last };
+
+			position_kind position() const { return m_position; }
+			bool has_position() const { return m_position != position_any; }
+
+			// 第 position 个匹配结果是否保留. 之后不会再有保留的结果时 done 为 true, 遍历可以停止.
+			// position_last 要看完所有结果才能确定, 由调用者处理.
+			bool keep_position(std::size_t position, bool& done) const;
+
 		private:
 			bool all_match = false;
 			std::vector<condition> m_conditions;
+			position_kind m_position = position_any;
+			std::size_t m_position_index = 0;
 
 			friend class basic_selector;
+			friend class basic_dom<CharType>;
 		};
 		typedef typename std::vector<selector_matcher>::const_iterator selector_matcher_iterator;
 
@@ -91,6 +135,363 @@ namespace html{
 		tag_close,
 	};
 
+	// dom_walk 访问者的返回值, 决定遍历如何继续.
+	enum walk_action{
+		walk_continue,			// 继续遍历子节点
+		walk_skip_children,		// 跳过子节点, 转到下一个兄弟节点
+		walk_stop,				// 立即终止整个遍历
+	};
+
+	// 解析时丢弃的内容, 被丢弃的部分仍然经过分词, 但不创建任何节点. tag 名不区分大小写.
+	template<typename CharType>
+	struct basic_parse_filter
+	{
+		// 这些 tag 连同整个子树 (包括 script / style 的内容) 都不建节点, 例如 script, style, svg
+		std::vector<std::basic_string<CharType>> drop_tags;
+
+		// 非空时只为这些 tag 建节点. 其它元素本身不建节点, 但它们的子节点和文本照常建立,
+		// 挂到最近的保留下来的祖先上, 例如只保留 a 时所有的 <a> 都成为根节点的子节点.
+		// 不在这里的 script 的内容被丢弃. <!DOCTYPE> 这类声明不受影响, drop_tags 优先
+		std::vector<std::basic_string<CharType>> keep_tags;
+
+		bool keep_comments = true;
+	};
+
+	typedef basic_parse_filter<char> parse_filter;
+	typedef basic_parse_filter<wchar_t> wparse_filter;
+	typedef basic_parse_filter<char16_t> u16parse_filter;
+
+	// basic_dom::memory_usage 的结果: 按类别估算的内存字节数, 不含分配器自身的簿记开销
+	struct dom_memory_usage
+	{
+		std::size_t nodes = 0;			// 节点对象及其 shared_ptr 控制块
+		std::size_t strings = 0;		// tag 名与文本
+		std::size_t attributes = 0;		// 属性 map 的树节点, 键和值, 以及还没有解码的原始属性
+		std::size_t children = 0;		// 子节点 vector
+		std::size_t lazy = 0;			// append_html_lazy 推迟的子树保留的页面副本与记录
+		std::size_t parser = 0;			// 还没有结束的增量解析的协程栈, freeze() 后为 0
+
+		std::size_t total() const { return nodes + strings + attributes + children + lazy + parser; }
+	};
+
+	/*
+	编译期 selector: 语法在编译期检查, 每一级展开成专用的匹配代码, 查询时不需要解析字符串, 也没有逐个 condition 的通用分派.
+	只支持由 tag, #id, .class 组成的复合选择器, 空格分隔的多级表示后代, 或者单独的 "*"; 只能是 ASCII.
+	其它写法 (属性, 伪类, 转义等) 编译失败, 请改用 basic_selector.
+	匹配规则与同样写法的 basic_selector 相同: tag 不区分大小写, #id 与 .class 和属性值整体比较.
+	同一个对象可以同时用于 dom, wdom 与 u16dom.
+
+		using namespace html::literals;
+		auto links = page["div.item a"_sel];			// GCC / Clang 的字符串字面量模板扩展, C++14 起可用
+		auto links = page[html::compile_selector<'d', 'i', 'v', ' ', 'a'>()];	// 标准写法
+	*/
+	template<class... Stages>
+	struct static_selector
+	{
+		static const std::size_t stage_count = sizeof...(Stages);
+	};
+
+	namespace detail {
+		// 与 basic_selector 的 tag 比较一致的大小写折叠
+		inline char fold_case(char c)
+		{
+			return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+		}
+
+		inline wchar_t fold_case(wchar_t c)
+		{
+			return static_cast<wchar_t>(std::towlower(c));
+		}
+
+		// 代理对不折叠, 只处理 BMP 内的字符
+		inline char16_t fold_case(char16_t c)
+		{
+			return static_cast<char16_t>(std::towlower(c));
+		}
+
+		// 编译期 selector 读取节点的入口
+		struct static_access
+		{
+			template<typename CharType>
+			static const std::basic_string<CharType>& tag_name(const basic_dom<CharType>& d)
+			{
+				return d.tag_name;
+			}
+
+			template<typename CharType>
+			static const std::basic_string<CharType>* attribute(const basic_dom<CharType>& d, const std::basic_string<CharType>& name)
+			{
+				return d.find_attribute(name);
+			}
+		};
+
+		template<char... Cs>
+		struct static_name
+		{
+			static const std::size_t size = sizeof...(Cs);
+
+			// 每种字符类型只构造一次, 匹配时不分配内存
+			template<typename CharType>
+			static const std::basic_string<CharType>& str()
+			{
+				static const std::basic_string<CharType> s{CharType(Cs)...};
+				return s;
+			}
+
+			template<typename CharType>
+			static bool equals(const std::basic_string<CharType>& s, bool ignore_case)
+			{
+				static const char name[] = {Cs..., 0};
+
+				if (s.size() != sizeof...(Cs))
+					return false;
+				for (std::size_t i = 0; i < sizeof...(Cs); i++)
+				{
+					if (ignore_case ? fold_case(s[i]) != fold_case(CharType(name[i])) : s[i] != CharType(name[i]))
+						return false;
+				}
+				return true;
+			}
+		};
+
+		template<class Name>
+		struct static_tag_condition
+		{
+			typedef Name tag_name;
+
+			template<typename CharType>
+			static bool match(const basic_dom<CharType>& d)
+			{
+				return Name::equals(static_access::tag_name(d), true);
+			}
+		};
+
+		template<class Name, class Attribute>
+		struct static_attribute_condition
+		{
+			typedef static_name<> tag_name;
+
+			template<typename CharType>
+			static bool match(const basic_dom<CharType>& d)
+			{
+				auto value = static_access::attribute(d, Attribute::template str<CharType>());
+				return value && Name::equals(*value, false);
+			}
+		};
+
+		// 一级复合选择器, 所有条件都满足才算匹配; 没有条件时匹配所有节点
+		template<class... Conditions>
+		struct static_compound;
+
+		template<>
+		struct static_compound<>
+		{
+			typedef static_name<> tag_name;
+
+			template<typename CharType>
+			static bool match(const basic_dom<CharType>&)
+			{
+				return true;
+			}
+		};
+
+		template<class First, class... Rest>
+		struct static_compound<First, Rest...>
+		{
+			// 匹配的节点必须有的 tag 名, 没有 tag 条件时为空. tag 条件总是在最前面
+			typedef typename First::tag_name tag_name;
+
+			template<typename CharType>
+			static bool match(const basic_dom<CharType>& d)
+			{
+				return First::match(d) && static_compound<Rest...>::match(d);
+			}
+		};
+
+		// 从 stage (第 Index 级之后还没有匹配的第一级) 开始, 节点依次满足的级都算匹配, 返回匹配之后的级数
+		template<std::size_t Index, class... Stages>
+		struct static_stages;
+
+		template<std::size_t Index>
+		struct static_stages<Index>
+		{
+			template<typename CharType>
+			static std::size_t advance(const basic_dom<CharType>&, std::size_t stage)
+			{
+				return stage;
+			}
+		};
+
+		template<std::size_t Index, class First, class... Rest>
+		struct static_stages<Index, First, Rest...>
+		{
+			template<typename CharType>
+			static std::size_t advance(const basic_dom<CharType>& d, std::size_t stage)
+			{
+				if (stage == Index && !First::match(d))
+					return stage;
+				return static_stages<Index + 1, Rest...>::advance(d, stage == Index ? stage + 1 : stage);
+			}
+		};
+
+		template<class... Stages>
+		struct static_last_stage;
+
+		template<class Last>
+		struct static_last_stage<Last>
+		{
+			typedef Last type;
+		};
+
+		template<class First, class... Rest>
+		struct static_last_stage<First, Rest...> : static_last_stage<Rest...>
+		{};
+
+		// 下面是逐字符解析 selector 的元函数
+		template<class Name, char C>
+		struct static_name_append;
+
+		template<char... Cs, char C>
+		struct static_name_append<static_name<Cs...>, C>
+		{
+			typedef static_name<Cs..., C> type;
+		};
+
+		template<class Compound, class Condition>
+		struct static_compound_append;
+
+		template<class... Conditions, class Condition>
+		struct static_compound_append<static_compound<Conditions...>, Condition>
+		{
+			typedef static_compound<Conditions..., Condition> type;
+		};
+
+		// Kind 为 0 (tag), '#' 或 '.', 表示 Name 是哪一种条件的名字
+		template<class Compound, char Kind, class Name>
+		struct static_flush_condition
+		{
+			static_assert(Kind == 0 || Name::size != 0, "html selector: '#' or '.' must be followed by a name");
+
+			typedef typename std::conditional<Kind == '#',
+				static_attribute_condition<Name, static_name<'i', 'd'>>,
+				static_attribute_condition<Name, static_name<'c', 'l', 'a', 's', 's'>>
+			>::type attribute_condition;
+
+			typedef typename std::conditional<Kind == 0,
+				static_tag_condition<Name>,
+				attribute_condition
+			>::type condition;
+
+			typedef typename std::conditional<Name::size == 0,
+				Compound,
+				typename static_compound_append<Compound, condition>::type
+			>::type type;
+		};
+
+		template<class Selector, class Compound>
+		struct static_push_stage;
+
+		template<class... Stages, class... Conditions>
+		struct static_push_stage<static_selector<Stages...>, static_compound<Conditions...>>
+		{
+			static_assert(sizeof...(Conditions) != 0, "html selector: empty compound selector (leading, trailing or repeated space)");
+
+			typedef static_selector<Stages..., static_compound<Conditions...>> type;
+		};
+
+		constexpr bool static_name_char(char c)
+		{
+			return c > ' ' && c < 127
+				&& c != '#' && c != '.' && c != '*' && c != '[' && c != ']' && c != ':' && c != '(' && c != ')'
+				&& c != '\\' && c != ',' && c != '>' && c != '+' && c != '~' && c != '=' && c != '"' && c != '\'';
+		}
+
+		// 读入一个字符后的解析状态: 已完成的各级 done, 当前一级已有的条件 conds, 当前条件的种类 kind 和已读入的名字 name
+		template<class Done, class Conds, char Kind, class Name, char C>
+		struct static_parse_step
+		{
+			static_assert(static_name_char(C), "html selector: only tag, #id, .class and ' ' are supported at compile time, use basic_selector instead");
+
+			typedef Done done;
+			typedef Conds conds;
+			static const char kind = Kind;
+			typedef typename static_name_append<Name, C>::type name;
+		};
+
+		template<class Done, class Conds, char Kind, class Name>
+		struct static_parse_step<Done, Conds, Kind, Name, ' '>
+		{
+			typedef typename static_push_stage<Done, typename static_flush_condition<Conds, Kind, Name>::type>::type done;
+			typedef static_compound<> conds;
+			static const char kind = 0;
+			typedef static_name<> name;
+		};
+
+		template<class Done, class Conds, char Kind, class Name>
+		struct static_parse_step<Done, Conds, Kind, Name, '#'>
+		{
+			typedef Done done;
+			typedef typename static_flush_condition<Conds, Kind, Name>::type conds;
+			static const char kind = '#';
+			typedef static_name<> name;
+		};
+
+		template<class Done, class Conds, char Kind, class Name>
+		struct static_parse_step<Done, Conds, Kind, Name, '.'>
+		{
+			typedef Done done;
+			typedef typename static_flush_condition<Conds, Kind, Name>::type conds;
+			static const char kind = '.';
+			typedef static_name<> name;
+		};
+
+		template<class Done, class Conds, char Kind, class Name, char... Cs>
+		struct static_parse;
+
+		template<class Done, class Conds, char Kind, class Name>
+		struct static_parse<Done, Conds, Kind, Name>
+		{
+			typedef typename static_push_stage<Done, typename static_flush_condition<Conds, Kind, Name>::type>::type type;
+		};
+
+		template<class Done, class Conds, char Kind, class Name, char C, char... Cs>
+		struct static_parse<Done, Conds, Kind, Name, C, Cs...>
+		{
+			typedef static_parse_step<Done, Conds, Kind, Name, C> step;
+			typedef typename static_parse<typename step::done, typename step::conds, step::kind, typename step::name, Cs...>::type type;
+		};
+
+		template<char... Cs>
+		struct parse_static_selector
+		{
+			typedef typename static_parse<static_selector<>, static_compound<>, 0, static_name<>, Cs...>::type type;
+		};
+
+		// 与 basic_selector 一样, "*" 匹配所有节点
+		template<>
+		struct parse_static_selector<'*'>
+		{
+			typedef static_selector<static_compound<>> type;
+		};
+	}
+
+	template<char... Cs>
+	using compile_selector = typename detail::parse_static_selector<Cs...>::type;
+
+#if defined(__GNUC__) && __cplusplus >= 201402L
+	inline namespace literals {
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wpedantic"
+		template<typename Char, Char... Cs>
+		constexpr compile_selector<char(Cs)...> operator"" _sel()
+		{
+			static_assert(std::is_same<Char, char>::value, "html selector: use a narrow string literal, the result works with wdom and u16dom too");
+			return compile_selector<char(Cs)...>();
+		}
+#	pragma GCC diagnostic pop
+	}
+#endif
+
 	namespace detail {
 		template<typename CharType>
 		class basic_dom_node_parser
@@ -104,7 +505,7 @@ namespace html{
 		public: // only for signals2
 			basic_dom_node_parser(const basic_dom_node_parser&);
 			// called from dom
-			void operator()(tag_stage, std::shared_ptr<basic_dom<CharType>>);
+			void operator()(tag_stage, const std::shared_ptr<basic_dom<CharType>>&);
 
 		public: // interface
 			template<typename Handler>
@@ -164,14 +565,93 @@ namespace html{
 		// 喂入一html片段.
 		detail::basic_dom_node_parser<CharType> append_partial_html(const std::basic_string<CharType>&);
 
+		// 设置解析时丢弃哪些内容, 必须在第一次喂入 html 之前调用, 否则抛出 std::logic_error.
+		void set_parse_filter(const basic_parse_filter<CharType>&);
+
+		/*
+		喂入一个完整的大页面, 分词与建树分别在两个线程上流水进行, 中间用无锁的单生产者单消费者环形队列传递记录.
+		结果与 append_partial_html 相同, 但不发出节点信号; 之后再喂入的片段从根节点开始解析.
+		页面短于 serial_threshold, 只有一个核, 或者已经有增量解析在进行时, 直接退化为 append_partial_html.
+		serial_threshold 为 0 时即使只有一个核也使用两个线程.
+		分词线程上的异常在两个线程都结束后由调用线程重新抛出, 这时 DOM 中只有已经建好的部分.
+		*/
+		void append_html_pipelined(const std::basic_string<CharType>&, std::size_t serial_threshold = 1 << 20);
+
+		/*
+		惰性解析一个完整的页面: 只为深度不超过 eager_depth 的节点建树 (this 的子节点深度为 1),
+		更深的子树先只经过分词, 记下它在页面中的范围和其中出现的 tag 名, 直到查询或 get_children 第一次进入时才建树.
+		查询会跳过不可能包含所需 tag 的未展开子树. 展开的属性仍在第一次读取时解码,
+		所以多个线程同时查询之前同样需要先 freeze(); 冻结后子树不展开, 多个线程同时进入同一棵子树时它只被解析一次.
+		结果与 append_partial_html 相同, 但不发出节点信号; 之后再喂入的片段从根节点开始解析.
+		页面被复制一份, 直到所有子树都展开. 已经设置 parse filter 或有增量解析在进行时退化为 append_partial_html.
+		*/
+		void append_html_lazy(const std::basic_string<CharType>&, std::size_t eager_depth = 2);
+
 	public:
 		/*
 		传入的 select 语法，先是通过 basic_selector 的构造函数，生成一个 basic_selector 对象
 		解析完毕后，根据 basic_selector 的 condition 对象进行匹配。
 		只有解析成功以后。dom 对象这个容器才会被填充进对应的内容，否则全部都为空
+		遍历与匹配本身不操作引用计数, 但结果以 shared_ptr 的副本保存, 每个结果节点仍有一次原子的引用计数增减.
+		query, select_batch 与 select_parallel 也是如此, 只读的热路径请用返回裸指针的 select().
 		*/
 		basic_dom<CharType>  operator[](const basic_selector<CharType>&) const;
 
+		/*
+		与 operator[] 结果相同, 但每一级 selector_matcher 的匹配会把子树分给多个线程并行处理,
+		结果按文档顺序合并. 待匹配的节点数少于 serial_threshold 时自动退化为 operator[].
+		并行匹配期间不可修改 DOM.
+		*/
+		basic_dom<CharType> select_parallel(const basic_selector<CharType>&, std::size_t serial_threshold = 16384, unsigned threads = 0) const;
+
+		/*
+		一次遍历同时求值多个 selector, 返回值与逐个调用 operator[] 的结果一一对应.
+		各 selector 的每一级 selector_matcher 按 tag/id/class 登记到分派表中,
+		每个节点只需要检查可能与它匹配的那些 matcher.
+		*/
+		std::vector<basic_dom<CharType>> select_batch(const std::vector<basic_selector<CharType>>&) const;
+
+		/*
+		冻结 DOM: 结束解析协程, 解码所有节点的属性并收紧容器容量, 之后 append_partial_html 会抛出 std::logic_error.
+		冻结后文档不再有任何写入, 所有 const 成员函数都可以被多个线程同时调用.
+		*/
+		void freeze();
+
+		bool frozen() const { return m_frozen; }
+
+		// 估算 this 及所有后代占用的内存, this 对象本身不计入. 不展开惰性子树.
+		// 遍历时读取惰性子树的状态, 不能与其它线程上展开子树的查询同时调用.
+		dom_memory_usage memory_usage() const;
+
+		/*
+		解析结束后收紧内存: 先 freeze(), 再收紧文档字符串池的散列表.
+		惰性子树不展开, 之后展开时只按 freeze() 的规则收紧.
+		*/
+		void compact();
+
+		/*
+		与 operator[] 匹配规则相同, 但最多返回 limit 个结果 (文档中最前面的), 结果够数即停止遍历.
+		selector 最后一级的 :first, :eq(n), :lt(n) 同样在结果确定后停止遍历.
+		*/
+		basic_dom<CharType> query(const basic_selector<CharType>&, std::size_t limit) const;
+
+		// 第一个匹配的节点, 没有时返回 nullptr. 找到即停止遍历.
+		std::shared_ptr<basic_dom<CharType>> query_first(const basic_selector<CharType>&) const;
+
+		/*
+		与 operator[] 匹配规则相同, 但返回指向文档内节点的裸指针, 不复制 shared_ptr.
+		这是唯一完全不碰引用计数的查询接口, 多线程查询冻结的 DOM 时不会争用节点引用计数所在的缓存行.
+		指针在文档存活期间有效.
+		*/
+		std::vector<const basic_dom<CharType>*> select(const basic_selector<CharType>&) const;
+
+		// 编译期 selector 的查询, 结果与同样写法的 basic_selector 相同
+		template<class... Stages>
+		basic_dom<CharType> operator[](const static_selector<Stages...>&) const;
+
+		template<class... Stages>
+		std::vector<const basic_dom<CharType>*> select(const static_selector<Stages...>&) const;
+
 		std::basic_string<CharType> to_html() const;
 
 		std::basic_string<CharType> to_plain_text() const;
@@ -185,29 +665,51 @@ namespace html{
 			return basic_charset(default_charset);
 		}
 
-		std::vector<std::shared_ptr<basic_dom<CharType>>> get_children(){
+		const std::vector<std::shared_ptr<basic_dom<CharType>>>& get_children() const{
+			if (m_lazy)
+				materialize();
 			return children;
 		}
 
-		std::basic_string<CharType> get_attr(const std::basic_string<CharType>& attr)
+		// 节点在文档中的先序编号, 解析时分配, 之后的节点编号更大. 编号可能不连续.
+		std::size_t document_order() const { return m_order; }
+
+		// d 是 this 的后代 (不含 this 本身). 只比较两个编号, 两个节点必须来自同一个文档.
+		bool contains(const basic_dom<CharType>& d) const
 		{
-			auto it = attributes.find(attr);
+			return m_order < d.m_order && d.m_order <= m_subtree_end;
+		}
 
-			if (it==attributes.end())
+		/*
+		两个查询结果 (operator[] 的返回值) 的并集与交集, 按文档顺序排列, 不含重复的节点.
+		查询结果本来就按文档顺序排列, 只需要一次线性合并. 节点必须来自同一个文档.
+		*/
+		basic_dom<CharType> operator|(const basic_dom<CharType>&) const;
+		basic_dom<CharType> operator&(const basic_dom<CharType>&) const;
+
+		std::basic_string<CharType> get_attr(const std::basic_string<CharType>& attr) const
+		{
+			auto value = find_attribute(attr);
+
+			if (!value)
 			{
 				return std::basic_string<CharType>();
 			}
 
-			return it->second;
+			return *value;
 		}
 
 	private:
-		void html_parser(typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::pull_type & html_page_source);
+		void html_parser(typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::pull_type & html_page_source, std::shared_ptr<const basic_parse_filter<CharType>> filter);
 		typename boost::coroutines::asymmetric_coroutine<const std::basic_string<CharType>*>::push_type html_parser_feeder;
 		bool html_parser_feeder_inialized = false;
+		bool m_frozen = false;
+		// 只在有回调连接的解析过程中为 true, 否则解析时完全不发信号
+		bool m_signal_connected = false;
 
 		typedef std::shared_ptr<basic_dom<CharType>> basic_dom_ptr;
-		boost::signals2::signal<void(tag_stage, basic_dom_ptr)> m_new_node_signal;
+		// 只有喂入 html 的根节点需要, 第一次连接回调时才创建
+		std::unique_ptr<boost::signals2::signal<void(tag_stage, const basic_dom_ptr&)>> m_new_node_signal;
 
  		std::basic_string<CharType> basic_charset(const std::string& default_charset) const;
 
@@ -215,22 +717,349 @@ namespace html{
 
 		void to_html(std::basic_ostream<CharType>*, int deep) const;
 
+		// 属性名保存在文档的字符串池里, 节点只持有指针, 按名字的内容排序. 属性值存放在表里.
+		typedef std::map<const std::basic_string<CharType>*, std::basic_string<CharType>, detail::pooled_less<CharType>> attribute_map;
+
+		// 属性在解析时只保存原始字节, 第一次读取时才解码到 attributes.
+		// 因此未冻结的 DOM 被多个线程同时读取属性之前需要先 freeze().
+		const attribute_map& decoded_attributes() const;
+
+		// 属性值, 没有这个属性时返回 nullptr
+		const std::basic_string<CharType>* find_attribute(const std::basic_string<CharType>& name) const
+		{
+			auto & attributes = decoded_attributes();
+			auto it = attributes.find(&name);
+			return it == attributes.end() ? nullptr : &it->second;
+		}
 
-		std::map<std::basic_string<CharType>, std::basic_string<CharType>> attributes;
+		mutable attribute_map attributes;
+		mutable std::basic_string<CharType> m_raw_attributes;
+		// attributes 中的属性名所在的池, 节点可能比文档的根节点活得久, 因此共同持有.
+		// 计数放在池里, 每个节点只多一个指针
+		boost::intrusive_ptr<detail::string_pool<CharType>> m_pool;
 		std::basic_string<CharType> tag_name;
 
 		std::basic_string<CharType> content_text;
-		std::vector<basic_dom_ptr> children;
+		// append_html_lazy 推迟的子树由 materialize 在 const 访问中填入
+		mutable std::vector<basic_dom_ptr> children;
 		basic_dom<CharType>* m_parent;
 
-		template<class T>
-		static void dom_walk(basic_dom_ptr d, T handler);
+		// 先序编号与子树中最大的编号, 由 tree_builder 分配. 还没有关闭的节点 m_subtree_end 为最大值.
+		// 推迟建树的子树按页面范围的长度预留编号, 展开时在预留的范围内编号.
+		std::size_t m_order = 0;
+		std::size_t m_subtree_end = std::size_t(-1);
+
+		struct document_order_less
+		{
+			template<class Ptr>
+			bool operator()(const Ptr& a, const Ptr& b) const
+			{
+				return a->m_order < b->m_order || (a->m_order == b->m_order && std::less<const void*>()(&*a, &*b));
+			}
+		};
+
+		// children 按文档顺序排列且互不包含. 文档里的节点和查询结果总是这样, 并集的结果则可能互相包含
+		bool children_disjoint() const;
+
+		// 按文档顺序排序并去掉重复的节点, 已经有序时只需要线性扫描一遍
+		template<class Ptr>
+		static void unique_in_document_order(std::vector<Ptr>& nodes)
+		{
+			if (!std::is_sorted(nodes.begin(), nodes.end(), document_order_less()))
+				std::sort(nodes.begin(), nodes.end(), document_order_less());
+			nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+		}
+
+		// 非空时 children 来自页面中的一段范围, 第一次访问时解析
+		std::shared_ptr<detail::lazy_subtree<CharType>> m_lazy;
+		void materialize() const;
+
+		// 子树里可能有能被 matcher 匹配的节点. 只对 append_html_lazy 推迟的子树做判断, 其余总是返回 true.
+		bool may_contain(const typename basic_selector<CharType>::selector_matcher&) const;
+		// 同上, 匹配的节点 tag 名必须等于 *tag_name (不区分大小写), nullptr 表示没有这个条件
+		bool may_contain(const std::basic_string<CharType>* tag_name) const;
+
+		// 非递归先序遍历 root 的所有后代节点 (不含 root 本身).
+		// enter 在进入节点时调用, 返回 walk_action; leave 在节点的子树遍历结束后调用.
+		// 被 walk_stop 终止时返回 false.
+		template<class Enter, class Leave>
+		static bool dom_walk(const basic_dom<CharType>& root, Enter&& enter, Leave&& leave);
+
+		template<class Enter>
+		static bool dom_walk(const basic_dom<CharType>& root, Enter&& enter);
+
+		// 按文档顺序对每个匹配节点调用 out(const basic_dom_ptr&), operator[], select 与 query 共用.
+		// out 返回 false 时立即停止遍历.
+		template<class Output>
+		void select_into(const basic_selector<CharType>&, Output&& out) const;
+
+		// 一级 matcher 的匹配: starts 中的节点本身及其后代都是候选, 按位置筛选后交给 out. 被 out 停止时返回 false.
+		template<class Output>
+		static bool select_stage(const std::vector<basic_dom_ptr>& starts, const typename basic_selector<CharType>::selector_matcher&, Output& out);
+
+		// 多级 selector 的单次遍历实现: 从右往左匹配, 用祖先 Bloom filter 快速排除候选. 被 out 停止时返回 false.
+		template<class Output>
+		bool select_descendant(const basic_selector<CharType>&, Output& out) const;
+
+		// 编译期 selector 的单次遍历实现
+		template<class Output, class... Stages>
+		void select_static(const static_selector<Stages...>&, Output&& out) const;
 
 		friend class basic_selector<CharType>;
 		friend class detail::basic_dom_node_parser<CharType>;
+		friend class detail::ancestor_filter<CharType>;
+		friend class detail::tree_builder<CharType>;
+		friend struct detail::static_access;
 	};
 
 	typedef basic_dom<char> dom;
 	typedef basic_dom<wchar_t> wdom;
+	// UTF-16 的 DOM, 与 wdom 的匹配规则相同, 但 Linux 上每个字符只占 wdom 一半的空间.
+	// 代理对按两个码元原样保存, 大小写不敏感的比较只折叠 BMP 内的字符.
+	typedef basic_dom<char16_t> u16dom;
+
+	template<typename CharType> template<class Enter, class Leave>
+	bool basic_dom<CharType>::dom_walk(const basic_dom<CharType>& root, Enter&& enter, Leave&& leave)
+	{
+		typedef typename std::vector<basic_dom_ptr>::const_iterator child_iterator;
+
+		struct walk_frame
+		{
+			const basic_dom<CharType>* node;
+			child_iterator next;
+		};
+
+		// 用显式栈代替递归, 嵌套再深也不会栈溢出
+		std::vector<walk_frame> stack;
+		// get_children 展开惰性子树, 之后 children 不再变化
+		stack.push_back(walk_frame{&root, root.get_children().begin()});
+
+		while (!stack.empty())
+		{
+			walk_frame& top = stack.back();
+
+			if (top.next == top.node->children.end())
+			{
+				if (stack.size() > 1)
+					leave(*top.node);
+				stack.pop_back();
+				continue;
+			}
+
+			const basic_dom_ptr& c = *top.next++;
+
+			switch (enter(c))
+			{
+				case walk_stop:
+					return false;
+				case walk_skip_children:
+					leave(*c);
+					break;
+				case walk_continue:
+					stack.push_back(walk_frame{c.get(), c->get_children().begin()});
+					break;
+			}
+		}
+
+		return true;
+	}
+
+	template<typename CharType> template<class Enter>
+	bool basic_dom<CharType>::dom_walk(const basic_dom<CharType>& root, Enter&& enter)
+	{
+		return dom_walk(root, std::forward<Enter>(enter), [](const basic_dom<CharType>&){});
+	}
+
+	template<typename CharType> template<class Output, class... Stages>
+	void basic_dom<CharType>::select_static(const static_selector<Stages...>&, Output&& out) const
+	{
+		typedef detail::static_stages<0, Stages...> stages;
+
+		const std::basic_string<CharType>& last_tag = detail::static_last_stage<Stages...>::type::tag_name::template str<CharType>();
+		const std::basic_string<CharType>* required = last_tag.empty() ? nullptr : &last_tag;
+
+		// 每个节点从父节点已经匹配到的级数出发依次检查之后的各级, 与 select_descendant 从上往下的重放结果相同,
+		// 但每个节点只检查一次. 走完所有级的节点就是结果, 不再遍历它的子节点.
+		std::vector<std::size_t> reached;
+
+		dom_walk(*this, [&](const basic_dom_ptr& node)
+		{
+			std::size_t stage = reached.empty() ? 0 : reached.back();
+			reached.push_back(stage);
+
+			// 注释节点只有作为 this 的直接子节点时才是候选
+			if (reached.size() > 1 && detail::static_name<'<', '!', '-', '-'>::equals(node->tag_name, false))
+				return walk_skip_children;
+
+			stage = stages::advance(*node, stage);
+			if (stage == sizeof...(Stages))
+			{
+				out(node);
+				return walk_skip_children;
+			}
+
+			reached.back() = stage;
+			return node->may_contain(required) ? walk_continue : walk_skip_children;
+		}, [&reached](const basic_dom<CharType>&)
+		{
+			reached.pop_back();
+		});
+	}
+
+	template<typename CharType> template<class... Stages>
+	basic_dom<CharType> basic_dom<CharType>::operator[](const static_selector<Stages...>& selector_) const
+	{
+		basic_dom<CharType> matched_dom;
+
+		select_static(selector_, [&matched_dom](const basic_dom_ptr& i)
+		{
+			matched_dom.children.push_back(i);
+		});
+
+		// 互相包含的起点会重复找到同一个节点
+		if (!children_disjoint())
+			unique_in_document_order(matched_dom.children);
+
+		return matched_dom;
+	}
+
+	template<typename CharType> template<class... Stages>
+	std::vector<const basic_dom<CharType>*> basic_dom<CharType>::select(const static_selector<Stages...>& selector_) const
+	{
+		std::vector<const basic_dom<CharType>*> result;
+
+		select_static(selector_, [&result](const basic_dom_ptr& i)
+		{
+			result.push_back(i.get());
+		});
+
+		if (!children_disjoint())
+			unique_in_document_order(result);
+
+		return result;
+	}
+
+	enum token_kind{
+		token_start_tag,		// <tag k=v>, <!xxx> 也作为 start tag 给出
+		token_end_tag,			// </tag>
+		token_text,				// 文本, 以及 script 的内容
+		token_comment,			// <!-- -->
+	};
+
+	// basic_tokenizer 给出的 token. 其中的字符串是 token 自己的缓冲区, 不是指向页面的视图,
+	// 分词时与状态机的缓冲区交换而不是复制, 在 token 之间复用, 预热之后摊销下来不再分配.
+	// 内容只在下一次 next() 之前有效.
+	template<typename CharType>
+	class basic_token
+	{
+	public:
+		token_kind kind() const { return m_kind; }
+
+		// start / end tag 的名字
+		const std::basic_string<CharType>& name() const { return m_name; }
+
+		// 文本或注释的内容
+		const std::basic_string<CharType>& text() const { return m_text; }
+
+		// <tag ... /> 形式的 start tag
+		bool self_closing() const { return m_self_closing; }
+
+		// start tag 的属性, 按出现顺序排列, 不去重
+		std::size_t attribute_count() const { return m_attribute_count; }
+		const std::basic_string<CharType>& attribute_name(std::size_t i) const { return m_attributes[i].first; }
+		const std::basic_string<CharType>& attribute_value(std::size_t i) const { return m_attributes[i].second; }
+
+	private:
+		token_kind m_kind = token_text;
+		bool m_self_closing = false;
+		std::basic_string<CharType> m_name;
+		std::basic_string<CharType> m_text;
+		// 缓冲区会被后续 token 复用, 只有前 m_attribute_count 个有效
+		std::vector<std::pair<std::basic_string<CharType>, std::basic_string<CharType>>> m_attributes;
+		std::size_t m_attribute_count = 0;
+
+		friend class detail::token_sink<CharType>;
+	};
+
+	/*
+	只分词不建树: 与 basic_dom 使用同一个状态机, 但不创建节点, 不发信号, 也不维护父节点指针.
+	与 append_partial_html 一样, 页面末尾还没有结束的文本和 tag 不会给出.
+
+		html::tokenizer t(page);
+		while (auto token = t.next())
+			...
+
+	page 必须在 tokenizer 的整个生命周期内有效.
+	*/
+	template<typename CharType>
+	class basic_tokenizer
+	{
+	public:
+		explicit basic_tokenizer(const std::basic_string<CharType>& html_page);
+
+		basic_tokenizer(const basic_tokenizer&) = delete;
+		basic_tokenizer& operator = (const basic_tokenizer&) = delete;
+
+		// 取下一个 token, 分词结束时返回 nullptr.
+		const basic_token<CharType>* next();
+
+	private:
+		basic_token<CharType> m_token;
+		bool m_started = false;
+		bool m_finished = false;
+		typename boost::coroutines::asymmetric_coroutine<const basic_token<CharType>*>::pull_type m_tokens;
+	};
+
+	typedef basic_token<char> token;
+	typedef basic_token<wchar_t> wtoken;
+	typedef basic_token<char16_t> u16token;
+	typedef basic_tokenizer<char> tokenizer;
+	typedef basic_tokenizer<wchar_t> wtokenizer;
+	typedef basic_tokenizer<char16_t> u16tokenizer;
+
+	// extract_links 的结果
+	template<typename CharType>
+	struct basic_link
+	{
+		std::basic_string<CharType> tag_name;	// a, link 或 img
+		std::basic_string<CharType> url;		// a / link 的 href, img 的 src
+		std::basic_string<CharType> rel;
+	};
+
+	// extract_meta 的结果, 没有的属性为空
+	template<typename CharType>
+	struct basic_meta
+	{
+		std::basic_string<CharType> name;
+		std::basic_string<CharType> property;
+		std::basic_string<CharType> http_equiv;
+		std::basic_string<CharType> content;
+		std::basic_string<CharType> charset;
+	};
+
+	/*
+	只分词不建树的专用提取器, 按文档顺序把结果追加到 out.
+	tag 名和属性名都不区分大小写, 同名属性以最后一个为准.
+	不考虑嵌套: 嵌套在另一个匹配元素里的元素 (例如没有关闭的 <meta> 之后的 <meta>) 同样会被提取.
+	*/
+
+	// a[href], link[href], img[src]
+	template<typename CharType>
+	void extract_links(const std::basic_string<CharType>& html_page, std::vector<basic_link<CharType>>& out);
+
+	// 所有 <meta>
+	template<typename CharType>
+	void extract_meta(const std::basic_string<CharType>& html_page, std::vector<basic_meta<CharType>>& out);
+
+	// <script type="application/ld+json"> 的内容. type 两端的空白和 ";charset=utf-8" 这样的参数会被忽略
+	template<typename CharType>
+	void extract_json_ld(const std::basic_string<CharType>& html_page, std::vector<std::basic_string<CharType>>& out);
+
+	typedef basic_link<char> link;
+	typedef basic_link<wchar_t> wlink;
+	typedef basic_link<char16_t> u16link;
+	typedef basic_meta<char> meta;
+	typedef basic_meta<wchar_t> wmeta;
+	typedef basic_meta<char16_t> u16meta;
 
 } // namespace html
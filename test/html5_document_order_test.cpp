@@ -0,0 +1,218 @@
+/*
+ * document_order(), contains() and the union / intersection of query results,
+ * checked against a plain recursive walk of the tree.
+ *
+ * g++ -std=c++11 -O2 -I.. html5_document_order_test.cpp -x c++ ../html5.c -lboost_regex -lboost_coroutine -lboost_context -lboost_thread -pthread -o html5_document_order_test && ./html5_document_order_test
+ */
+
+#include "html5.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+			failures++; \
+		} \
+	} while (0)
+
+typedef std::vector<const html::dom*> node_list;
+
+static const char* page =
+	"<html><body>"
+	"<div id=d1 class=x><p class=a>one<b>1</b></p><p>two</p><a href=/1>l1</a></div>"
+	"<div id=d2><p class=a>three</p><div id=d3 class=x><p>four<a href=/2>l2</a></p></div></div>"
+	"<p class=a>five</p>"
+	"</body></html>";
+
+// 先序遍历, 不含 root 本身
+static void preorder(const html::dom& root, node_list& out)
+{
+	for (auto & c : root.get_children())
+	{
+		out.push_back(c.get());
+		preorder(*c, out);
+	}
+}
+
+static node_list descendants(const html::dom& root)
+{
+	node_list out;
+	preorder(root, out);
+	return out;
+}
+
+static node_list nodes(const html::dom& result)
+{
+	node_list out;
+	for (auto & c : result.get_children())
+		out.push_back(c.get());
+	return out;
+}
+
+static bool in_document_order(const node_list& list)
+{
+	for (std::size_t i = 1; i < list.size(); i++)
+		if (list[i - 1]->document_order() >= list[i]->document_order())
+			return false;
+	return true;
+}
+
+// 按文档顺序排列且每个节点只出现一次的并集 / 交集
+static node_list expected_union(const node_list& all, const node_list& a, const node_list& b)
+{
+	node_list out;
+	for (auto n : all)
+		if (std::find(a.begin(), a.end(), n) != a.end() || std::find(b.begin(), b.end(), n) != b.end())
+			out.push_back(n);
+	return out;
+}
+
+static node_list expected_intersection(const node_list& all, const node_list& a, const node_list& b)
+{
+	node_list out;
+	for (auto n : all)
+		if (std::find(a.begin(), a.end(), n) != a.end() && std::find(b.begin(), b.end(), n) != b.end())
+			out.push_back(n);
+	return out;
+}
+
+static void check_order_and_contains(const html::dom& d)
+{
+	node_list all = descendants(d);
+	CHECK(!all.empty());
+	CHECK(in_document_order(all));
+
+	// contains 与递归遍历得到的后代完全一致, 节点不包含自己
+	for (auto n : all)
+	{
+		node_list inner = descendants(*n);
+		for (auto m : all)
+		{
+			bool expected = std::find(inner.begin(), inner.end(), m) != inner.end();
+			CHECK(n->contains(*m) == expected);
+		}
+		CHECK(!n->contains(*n));
+	}
+}
+
+static void test_order_and_contains()
+{
+	html::dom eager;
+	eager.append_partial_html(page);
+	check_order_and_contains(eager);
+
+	// 惰性子树在展开时在预留的范围内编号
+	html::dom lazy;
+	lazy.append_html_lazy(page, 1);
+	check_order_and_contains(lazy);
+
+	// 之后喂入的片段编号更大, 已经关闭的节点不包含它们
+	html::dom appended;
+	appended.append_partial_html("<div id=first><p>a</p></div>");
+	auto first = appended["#first"].get_children().at(0);
+	appended.append_partial_html("<div id=second><p>b</p></div>");
+	auto second = appended["#second"].get_children().at(0);
+	CHECK(first->document_order() < second->document_order());
+	CHECK(!first->contains(*second));
+	CHECK(!second->contains(*first));
+	check_order_and_contains(appended);
+}
+
+static void test_union_and_intersection()
+{
+	html::dom d;
+	d.append_partial_html(page);
+	node_list all = descendants(d);
+
+	auto divs = d["div"];
+	auto x = d[".x"];
+	auto ps = d["p"];
+	auto pa = d["p.a"];
+	auto links = d["a"];
+
+	// 互相重叠的结果: 公共节点只出现一次
+	auto u = divs | x;
+	CHECK(nodes(u) == expected_union(all, nodes(divs), nodes(x)));
+	CHECK(nodes(u).size() < nodes(divs).size() + nodes(x).size());
+	auto i = divs & x;
+	CHECK(nodes(i) == expected_intersection(all, nodes(divs), nodes(x)));
+	CHECK(!nodes(i).empty());
+
+	CHECK(nodes(ps | pa) == nodes(ps));
+	CHECK(nodes(ps & pa) == nodes(pa));
+
+	// 不相交的结果交错合并, 交集为空, 与参数的先后无关
+	auto pl = ps | links;
+	CHECK(nodes(pl) == expected_union(all, nodes(ps), nodes(links)));
+	CHECK(nodes(pl) == nodes(links | ps));
+	CHECK(in_document_order(nodes(pl)));
+	CHECK(nodes(ps & links).empty());
+
+	// 自身的并集与交集不变, 与空结果的并集不变, 交集为空
+	CHECK(nodes(ps | ps) == nodes(ps));
+	CHECK(nodes(ps & ps) == nodes(ps));
+	auto none = d["table"];
+	CHECK(nodes(ps | none) == nodes(ps));
+	CHECK(nodes(none | ps) == nodes(ps));
+	CHECK(nodes(ps & none).empty());
+}
+
+static void test_different_subtrees()
+{
+	html::dom d;
+	d.append_partial_html(page);
+	node_list all = descendants(d);
+
+	auto d1 = d["#d1"].get_children().at(0);
+	auto d2 = d["#d2"].get_children().at(0);
+	CHECK(d1->document_order() < d2->document_order());
+
+	auto p1 = (*d1)["p"];
+	auto p2 = (*d2)["p"];
+	CHECK(nodes(p1).size() == 2);
+	CHECK(nodes(p2).size() == 2);
+
+	// 来自不同子树的结果: 并集按文档顺序, 与参数的先后无关; 交集为空
+	auto u = p2 | p1;
+	CHECK(nodes(u) == expected_union(all, nodes(p1), nodes(p2)));
+	CHECK(nodes(u) == nodes(p1 | p2));
+	CHECK(nodes(u).size() == 4);
+	CHECK(nodes(p1 & p2).empty());
+
+	// 一棵子树的结果与整个文档的结果
+	CHECK(nodes(p2 & d["p.a"]) == expected_intersection(all, nodes(p2), nodes(d["p.a"])));
+	CHECK(nodes(p2 & d["p.a"]).size() == 1);
+	CHECK(nodes(p1 | d["p"]) == nodes(d["p"]));
+
+	// 子节点互相包含的并集 (div 与嵌套在里面的 div) 上再查询, 结果不重复且按文档顺序
+	auto nested = d["#d2"] | d["#d3"];
+	CHECK(nodes(nested).size() == 2);
+	CHECK(d2->contains(*nodes(nested)[1]));
+	auto inner = nested["p"];
+	CHECK(in_document_order(nodes(inner)));
+	CHECK(nodes(inner) == nodes((*d2)["p"]));
+	CHECK(nodes(nested["a"]).size() == 1);
+}
+
+int main()
+{
+	test_order_and_contains();
+	test_union_and_intersection();
+	test_different_subtrees();
+
+	if (failures)
+	{
+		std::cerr << failures << " check(s) failed" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "html5_document_order_test: all checks passed" << std::endl;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+/*
+ * append_html_pipelined with the two-thread path forced (serial_threshold 0),
+ * so it runs even on a single core.
+ *
+ * g++ -std=c++11 -O2 -I.. html5_pipelined_test.cpp -x c++ ../html5.c -lboost_regex -lboost_coroutine -lboost_context -lboost_thread -pthread -o html5_pipelined_test && ./html5_pipelined_test
+ */
+
+#include "html5.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+			failures++; \
+		} \
+	} while (0)
+
+// 只在分词线程 (不是主线程) 上让 operator new 失败
+static std::atomic<bool> fail_off_main_thread(false);
+static std::thread::id main_thread;
+
+void* operator new(std::size_t size)
+{
+	if (fail_off_main_thread.load() && std::this_thread::get_id() != main_thread)
+		throw std::bad_alloc();
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+// 远大于环形队列的容量, 覆盖生产者等待消费者的情况
+static std::string big_page()
+{
+	std::ostringstream page;
+	page << "<!DOCTYPE html><html><head><title>t</title><script>if (a < b) x = '</div>';</script></head><body>";
+	for (int i = 0; i < 20000; i++)
+	{
+		page << "<div class='item c" << i % 7 << "' data-id=" << i << "><!-- c" << i << " -->"
+			<< "<a href='/p/" << i << "'>item &amp; " << i << "</a><br/><p>text<b>bold</p></div>";
+	}
+	page << "</body></html><p>unclosed <span";
+	return page.str();
+}
+
+template<typename CharType>
+static void check_same_as_serial(const std::basic_string<CharType>& page)
+{
+	html::basic_dom<CharType> serial;
+	serial.append_partial_html(page);
+
+	html::basic_dom<CharType> pipelined;
+	pipelined.append_html_pipelined(page, 0);
+
+	CHECK(pipelined.to_html() == serial.to_html());
+
+	html::basic_selector<CharType> links(std::basic_string<CharType>(1, CharType('a')));
+	CHECK(pipelined[links].get_children().size() == serial[links].get_children().size());
+}
+
+static void test_same_as_serial()
+{
+	std::string page = big_page();
+	check_same_as_serial(page);
+	check_same_as_serial(std::wstring(page.begin(), page.end()));
+	check_same_as_serial(std::u16string(page.begin(), page.end()));
+
+	check_same_as_serial(std::string());
+	check_same_as_serial(std::string("<!doctype html><p>a<p>b"));
+	check_same_as_serial(std::string("text only"));
+}
+
+static void test_tokenizer_exception()
+{
+	std::string page = big_page();
+
+	html::dom d;
+	bool caught = false;
+	fail_off_main_thread = true;
+	try
+	{
+		d.append_html_pipelined(page, 0);
+	}
+	catch (const std::bad_alloc&)
+	{
+		caught = true;
+	}
+	fail_off_main_thread = false;
+	CHECK(caught);
+
+	// 失败之后文档仍然可用
+	html::dom again;
+	again.append_html_pipelined(page, 0);
+	CHECK(again["a"].get_children().size() == 20000);
+}
+
+int main()
+{
+	main_thread = std::this_thread::get_id();
+
+	test_same_as_serial();
+	test_tokenizer_exception();
+
+	if (failures)
+	{
+		std::cerr << failures << " check(s) failed" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "html5_pipelined_test: all checks passed" << std::endl;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+/*
+ * concurrent read-only use of an HtmlDocument after Freeze in html.h,
+ * meant to be run under ThreadSanitizer as well
+ *
+ * g++ -std=c++11 -O2 -I.. html_document_freeze_test.cpp -pthread -o html_document_freeze_test && ./html_document_freeze_test
+ * g++ -std=c++11 -O1 -g -fsanitize=thread -I.. html_document_freeze_test.cpp -pthread -o html_document_freeze_test && ./html_document_freeze_test
+ */
+
+#include "html.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+static const int kItems = 500;
+
+static std::string Page() {
+    std::ostringstream page;
+    page << "<html><body><div id=main class='list wide'>";
+    for (int i = 0; i < kItems; i++) {
+        page << "<p id=p" << i << " class='item c" << i % 5 << "'>"
+             << "<a href='/i/" << i << "' title=t" << i << ">" << i << "</a></p>";
+    }
+    page << "</div></body></html>";
+    return page.str();
+}
+
+// every reader touches each accessor that tokenizes attributes or builds indexes lazily
+static bool ReadAll(shared_ptr<HtmlDocument> doc) {
+    bool ok = true;
+    std::vector<shared_ptr<HtmlElement> > links = doc->GetElementByTagName("a");
+    ok = ok && links.size() == kItems;
+    for (size_t i = 0; i < links.size(); i++) {
+        std::ostringstream href;
+        href << "/i/" << i;
+        ok = ok && links[i]->GetAttribute("href") == href.str();
+        size_t attributes = 0;
+        for (HtmlElement::AttributeIterator it = links[i]->AttributeBegin(); it != links[i]->AttributeEnd(); ++it) {
+            attributes++;
+        }
+        ok = ok && attributes == 2;
+    }
+
+    // more than one class name goes through HasClassNames on every candidate
+    std::vector<shared_ptr<HtmlElement> > ps = doc->GetElementByClassName("item c3");
+    ok = ok && ps.size() == kItems / 5;
+    for (size_t i = 0; i < ps.size(); i++) {
+        ok = ok && ps[i]->GetAttribute("class") == "item c3";
+    }
+
+    ok = ok && doc->GetElementById("p7") && doc->GetElementById("p7")->GetAttribute("class") == "item c2";
+    ok = ok && doc->find("div.wide > p.c1 a[href]").size() == kItems / 5;
+    return ok;
+}
+
+static void TestConcurrentReadsAfterFreeze() {
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(Page());
+    doc->Freeze();
+    // a second call is harmless
+    doc->Freeze();
+
+    std::atomic<int> passed(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.push_back(std::thread([doc, &passed]() {
+            if (ReadAll(doc)) {
+                passed++;
+            }
+        }));
+    }
+    for (size_t t = 0; t < readers.size(); t++) {
+        readers[t].join();
+    }
+    CHECK(passed == 4);
+}
+
+static void TestFreezeKeepsResults() {
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> lazy = parser.Parse(Page());
+    shared_ptr<HtmlDocument> frozen = parser.Parse(Page());
+    frozen->Freeze();
+
+    CHECK(ReadAll(lazy));
+    CHECK(ReadAll(frozen));
+    CHECK(frozen->MemoryUsage().indexes == lazy->MemoryUsage().indexes);
+    CHECK(frozen->MemoryUsage().attributes == lazy->MemoryUsage().attributes);
+}
+
+int main() {
+    TestConcurrentReadsAfterFreeze();
+    TestFreezeKeepsResults();
+
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "html_document_freeze_test: all checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+/*
+ * throughput of HtmlSelector / HtmlElement::find in html.h
+ *
+ * g++ -std=c++11 -O2 -I.. html_selector_bench.cpp -o html_selector_bench && ./html_selector_bench [file.html]
+ *
+ * without a file a synthetic listing page is generated. every selector is
+ * compiled once and run until at least 0.2 s have passed; the report gives
+ * queries per second and elements visited per second.
+ */
+
+#include "html.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static std::string SyntheticPage() {
+    std::ostringstream page;
+    page << "<html><head><title>bench</title></head><body><div id=main>";
+    for (int i = 0; i < 2000; i++) {
+        page << "<div class='item c" << i % 7 << "' data-id=" << i << ">"
+             << "<h2><a href='/p/" << i << "' rel=nofollow>item " << i << "</a></h2>"
+             << "<ul><li>a</li><li class=price>" << i % 100 << "</li><li><span>c</span></li></ul>"
+             << "<p>text <b>bold</b> <i>italic</i></p>"
+             << "</div>";
+    }
+    page << "</div></body></html>";
+    return page.str();
+}
+
+static size_t CountElements(const shared_ptr<HtmlElement> &element) {
+    size_t count = 1;
+    for (size_t i = 0; ; i++) {
+        shared_ptr<HtmlElement> c = element->child(static_cast<long>(i));
+        if (!c) {
+            break;
+        }
+        count += CountElements(c);
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    std::string page;
+    if (argc > 1) {
+        std::ifstream file(argv[1], std::ios::binary);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        page = buffer.str();
+    } else {
+        page = SyntheticPage();
+    }
+
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(page);
+    std::vector<shared_ptr<HtmlElement> > html = doc->GetElementByTagName("html");
+    size_t elements = html.empty() ? 0 : CountElements(html[0]);
+    std::cout << page.size() << " bytes, " << elements << " elements" << std::endl;
+
+    const char *selectors[] = {
+        "a",
+        "#main",
+        ".item",
+        "div.item.c3",
+        "a[href^='/p/1']",
+        "li[class~=price]",
+        "div li",
+        "div > ul > li",
+        "body div.item ul li span",
+        "div.item > h2 > a[rel=nofollow]",
+        "p b, p i",
+    };
+
+    for (size_t s = 0; s < sizeof(selectors) / sizeof(selectors[0]); s++) {
+        HtmlSelector selector(selectors[s]);
+        size_t found = 0;
+        size_t runs = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        do {
+            found = doc->find(selector).size();
+            runs++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < 0.2);
+
+        std::cout << selectors[s] << ": " << found << " found, "
+                  << elapsed * 1000 / runs << " ms/query, "
+                  << runs / elapsed << " queries/s, "
+                  << elements * runs / elapsed / 1e6 << " M elements/s" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * behavior tests for HtmlSelector / HtmlElement::find in html.h
+ *
+ * g++ -std=c++11 -O2 -I.. html_selector_test.cpp -o html_selector_test && ./html_selector_test
+ */
+
+#include "html.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+// values of the matched elements in document order, joined by ','
+static std::string Values(shared_ptr<HtmlDocument> doc, const std::string &selector) {
+    std::vector<shared_ptr<HtmlElement> > found = doc->find(selector);
+    std::string values;
+    for (size_t i = 0; i < found.size(); i++) {
+        if (i) {
+            values += ',';
+        }
+        values += found[i]->GetValue();
+    }
+    return values;
+}
+
+static void TestSimpleSelectors() {
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(
+        "<div id=main class='box wide'>"
+        "<p class=box>1</p><p class='wide box big'>2</p><span id=x>3</span>"
+        "</div>");
+
+    CHECK(Values(doc, "p") == "1,2");
+    CHECK(Values(doc, "#x") == "3");
+    CHECK(Values(doc, "span#x") == "3");
+    CHECK(Values(doc, "p#x") == "");
+    CHECK(Values(doc, ".big") == "2");
+    CHECK(Values(doc, "p.box.wide") == "2");
+    CHECK(doc->find(".box").size() == 3);
+    CHECK(doc->find("*").size() == 4);
+    CHECK(Values(doc, "p, span") == "1,2,3");
+}
+
+static void TestCombinators() {
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(
+        "<ul id=outer>"
+        "<li>a<ul><li>b</li><li>c</li></ul></li>"
+        "<li>d</li>"
+        "</ul>"
+        "<ol><li>e</li></ol>");
+
+    // descendant: any depth
+    CHECK(Values(doc, "#outer li") == "a,b,c,d");
+    CHECK(Values(doc, "ul li") == "a,b,c,d");
+    CHECK(Values(doc, "ul ul li") == "b,c");
+    // child: direct children only
+    CHECK(Values(doc, "#outer > li") == "a,d");
+    CHECK(Values(doc, "li > ul > li") == "b,c");
+    CHECK(Values(doc, "#outer>li>ul>li") == "b,c");
+    CHECK(Values(doc, "ol > li") == "e");
+    CHECK(Values(doc, "ol > ul") == "");
+    // mixed: the child combinator binds the nearest compounds only
+    CHECK(Values(doc, "ul > li li") == "b,c");
+    CHECK(Values(doc, "ul li > ul > li") == "b,c");
+    // group: union in document order, without duplicates
+    CHECK(Values(doc, "ol li, ul ul li") == "b,c,e");
+    CHECK(Values(doc, "li, ul li") == "a,b,c,d,e");
+
+    // find on an element only returns its descendants
+    std::vector<shared_ptr<HtmlElement> > outer = doc->find("#outer");
+    CHECK(outer.size() == 1);
+    CHECK(outer[0]->find("li").size() == 4);
+    CHECK(outer[0]->find("ul").size() == 1);
+    CHECK(outer[0]->find("ol").empty());
+}
+
+static void TestAttributeOperators() {
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(
+        "<a href='http://a.example/x.pdf' lang=en-US rel='nofollow noopener'>1</a>"
+        "<a href='https://b.example/y.html' lang=en rel=noopener>2</a>"
+        "<a lang=english>3</a>"
+        "<a href=''>4</a>");
+
+    CHECK(Values(doc, "a[href]") == "1,2,4");
+    CHECK(Values(doc, "a[ href ]") == "1,2,4");
+    CHECK(Values(doc, "a[lang=en]") == "2");
+    CHECK(Values(doc, "a[lang='en-US']") == "1");
+    CHECK(Values(doc, "a[href=\"\"]") == "4");
+    CHECK(Values(doc, "a[rel~=noopener]") == "1,2");
+    CHECK(Values(doc, "a[rel~=follow]") == "");
+    CHECK(Values(doc, "a[lang|=en]") == "1,2");
+    CHECK(Values(doc, "a[href^=https]") == "2");
+    CHECK(Values(doc, "a[href^='']") == "");
+    CHECK(Values(doc, "a[href$=.pdf]") == "1");
+    CHECK(Values(doc, "a[href*=example]") == "1,2");
+    CHECK(Values(doc, "a[href*='']") == "");
+    // != also matches elements without the attribute
+    CHECK(Values(doc, "a[lang!=en]") == "1,3,4");
+    CHECK(Values(doc, "a[href][lang]") == "1,2");
+
+    CHECK(!HtmlSelector("a[href").IsValid());
+    CHECK(!HtmlSelector("a[href%=x]").IsValid());
+    CHECK(!HtmlSelector("a >").IsValid());
+    CHECK(doc->find("a[href").empty());
+}
+
+// descendant combinators used to backtrack over every ancestor at every
+// compound, each extra "div" multiplied the time by the nesting depth.
+static void TestDeepNesting() {
+    const int depth = 300;
+    std::string page = "<p>";
+    for (int i = 0; i < depth; i++) {
+        page += "<div>";
+    }
+    page += "<b>x</b>";
+    for (int i = 0; i < depth; i++) {
+        page += "</div>";
+    }
+    page += "</p>";
+
+    HtmlParser parser;
+    shared_ptr<HtmlDocument> doc = parser.Parse(page);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CHECK(doc->find("p div div b").size() == 1);
+    CHECK(doc->find("p div div div div b").size() == 1);
+    CHECK(doc->find("p div div div div div div div div b").size() == 1);
+    CHECK(doc->find("p div div div div i").empty());
+    CHECK(doc->find("i div div div div b").empty());
+    CHECK(doc->find("div > div div > div div b").size() == 1);
+    CHECK(doc->find("p > div > div > div b").size() == 1);
+    CHECK(doc->find("p > div > div > b").empty());
+    CHECK(doc->find("p div div").size() == depth - 1);
+    CHECK(doc->find("i div div").empty());
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    CHECK(elapsed < 1.0);
+}
+
+int main() {
+    TestSimpleSelectors();
+    TestCombinators();
+    TestAttributeOperators();
+    TestDeepNesting();
+
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "html_selector_test: all checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}